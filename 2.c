@@ -1,309 +1,6594 @@
+#define _GNU_SOURCE
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <sys/wait.h>
 #include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <endian.h>
+#include <time.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/resource.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
 
 #define MAX_N 15
 #define BLOCK_SIZE_BYTES(N) (((1 << N) + 7) / 8)
 
-int xorN(int fileCount, char *files[], int N) {
-    size_t blockSizeBytes = BLOCK_SIZE_BYTES(N);
-    uint8_t *blockMemory = (uint8_t *)calloc(blockSizeBytes, 1);
-    uint8_t *resultMemory = (uint8_t *)calloc(blockSizeBytes, 1);
-    if (blockMemory == NULL || resultMemory == NULL) {
-        printf("Cannot allocate memory for block or result\n");
-        free(blockMemory);
-        free(resultMemory);
+#define XOR_LANE_BYTES 64
+#define INPUT_BUFFER_SIZE (1 << 20)
+#define XOR_SPLIT_CHUNK ((size_t)64 << 20)
+#define XOR_SPLIT_MAX_WIDTH ((size_t)1 << 20)
+#define XOR_TILE_BYTES (16 << 10)
+#define MAX_XOR_N 30
+#define MAX_XOR_WIDTHS 8
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+#define MAX_MASKS 256
+#define MAX_GLOBS 64
+#define WALK_TASK_LIMIT 256
+#define DIRECT_IO_ALIGN 4096
+#define IO_BUFFER_POOL 64
+/* large page cache folios straddle chunk boundaries and are only dropped once wholly inside a dropped range */
+#define DROP_BEHIND_LAG ((uint64_t)4 << 20)
+
+enum { IO_STREAM, IO_MMAP, IO_URING, IO_PIPE, IO_DIRECT };
+enum { FORMAT_TEXT, FORMAT_NDJSON, FORMAT_BINARY };
+enum { CHECKSUM_CRC32C = 1, CHECKSUM_XXH64 = 2 };
+
+typedef struct {
+    int ioBackend;
+    uint64_t maskListLimit;
+    int jobs;
+    int isolate;
+    int stopOnMatch;
+    int queueDepth;
+    int format;
+    int maskHistogram;
+    int wordBits;
+    int bigEndian;
+    const char *cachePath;
+    int cacheCompact;
+    int findAll;
+    int findRegex;
+    int checksums;
+    int maskIndex;
+} Options;
+
+static Options options = { .ioBackend = IO_STREAM, .maskListLimit = UINT64_MAX, .queueDepth = 8, .format = FORMAT_TEXT,
+                           .wordBits = 32, .bigEndian = __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__ };
+
+static int worker_count(int tasks) {
+    int jobs = options.jobs;
+    if (jobs <= 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = cores > 0 ? (int)cores : 1;
+    }
+    if (jobs > tasks) {
+        jobs = tasks;
+    }
+    return jobs > 0 ? jobs : 1;
+}
+
+static int pwrite_all(int fd, const uint8_t *data, size_t length, off_t offset) {
+    while (length > 0) {
+        ssize_t bytes = pwrite(fd, data, length, offset);
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += bytes;
+        offset += bytes;
+        length -= (size_t)bytes;
+    }
+    return 0;
+}
+
+/* Fails with -1 on a read error and on a file that ends before length bytes. */
+static int pread_all(int fd, uint8_t *data, size_t length, off_t offset) {
+    while (length > 0) {
+        ssize_t bytes = pread(fd, data, length, offset);
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes <= 0) {
+            return -1;
+        }
+        data += bytes;
+        offset += bytes;
+        length -= (size_t)bytes;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const uint8_t *data, size_t length) {
+    while (length > 0) {
+        ssize_t bytes = write(fd, data, length);
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += bytes;
+        length -= (size_t)bytes;
+    }
+    return 0;
+}
+
+/*
+ * Fixed-size worker pool. Every worker owns a deque: it pops its own newest
+ * task and, when empty, steals the oldest task of another worker. Tasks may
+ * submit further tasks; pool_wait returns once all of them have finished.
+ */
+typedef struct {
+    void (*run)(void *arg);
+    void *arg;
+} PoolTask;
+
+typedef struct {
+    pthread_mutex_t lock;
+    PoolTask *items;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+} TaskDeque;
+
+typedef struct {
+    TaskDeque *deques;
+    pthread_t *threads;
+    int workerCount;
+    int threadCount;
+    int nextDeque;
+    long pending;
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t idle;
+} WorkerPool;
+
+typedef struct {
+    WorkerPool *pool;
+    int index;
+} PoolWorker;
+
+static __thread int currentWorker = -1;
+
+static int deque_push(TaskDeque *deque, PoolTask task) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail - deque->head == deque->capacity) {
+        size_t capacity = deque->capacity ? deque->capacity * 2 : 64;
+        PoolTask *items = (PoolTask *)malloc(capacity * sizeof(PoolTask));
+        if (items == NULL) {
+            pthread_mutex_unlock(&deque->lock);
+            return -1;
+        }
+        for (size_t i = deque->head; i < deque->tail; i++) {
+            items[i - deque->head] = deque->items[i % deque->capacity];
+        }
+        free(deque->items);
+        deque->items = items;
+        deque->tail -= deque->head;
+        deque->head = 0;
+        deque->capacity = capacity;
+    }
+    deque->items[deque->tail++ % deque->capacity] = task;
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+}
+
+static int deque_take(TaskDeque *deque, PoolTask *task, int steal) {
+    int taken = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head) {
+        if (steal) {
+            *task = deque->items[deque->head++ % deque->capacity];
+        } else {
+            *task = deque->items[--deque->tail % deque->capacity];
+        }
+        taken = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return taken;
+}
+
+static int pool_find_task(WorkerPool *pool, int self, PoolTask *task) {
+    if (deque_take(&pool->deques[self], task, 0)) {
+        return 1;
+    }
+    for (int i = 1; i < pool->workerCount; i++) {
+        if (deque_take(&pool->deques[(self + i) % pool->workerCount], task, 1)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void *pool_worker(void *arg) {
+    PoolWorker *worker = (PoolWorker *)arg;
+    WorkerPool *pool = worker->pool;
+    currentWorker = worker->index;
+    PoolTask task;
+    while (1) {
+        if (pool_find_task(pool, worker->index, &task)) {
+            task.run(task.arg);
+            pthread_mutex_lock(&pool->lock);
+            if (--pool->pending == 0) {
+                pthread_cond_broadcast(&pool->idle);
+            }
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        if (pool->stopping) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        /* re-check under the lock so a concurrent submit cannot be missed */
+        int queued = 0;
+        for (int i = 0; i < pool->workerCount && !queued; i++) {
+            TaskDeque *deque = &pool->deques[i];
+            pthread_mutex_lock(&deque->lock);
+            queued = deque->tail > deque->head;
+            pthread_mutex_unlock(&deque->lock);
+        }
+        if (!queued) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    free(worker);
+    return NULL;
+}
+
+static int pool_submit(WorkerPool *pool, void (*run)(void *arg), void *arg) {
+    PoolTask task = { run, arg };
+    int target = currentWorker;
+    pthread_mutex_lock(&pool->lock);
+    if (target < 0 || target >= pool->workerCount) {
+        target = pool->nextDeque;
+        pool->nextDeque = (pool->nextDeque + 1) % pool->workerCount;
+    }
+    pool->pending++;
+    if (deque_push(&pool->deques[target], task) != 0) {
+        pool->pending--;
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+    pthread_cond_signal(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+static void pool_wait(WorkerPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0) {
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void pool_stop(WorkerPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->threadCount; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    for (int i = 0; i < pool->workerCount; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].items);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->idle);
+    free(pool->deques);
+    free(pool->threads);
+}
+
+static int pool_start(WorkerPool *pool, int workerCount) {
+    memset(pool, 0, sizeof(*pool));
+    pool->deques = (TaskDeque *)calloc(workerCount, sizeof(TaskDeque));
+    pool->threads = (pthread_t *)calloc(workerCount, sizeof(pthread_t));
+    if (pool->deques == NULL || pool->threads == NULL) {
+        free(pool->deques);
+        free(pool->threads);
+        return -1;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    for (int i = 0; i < workerCount; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    }
+    /* deques of workers that fail to start are still drained by stealing */
+    pool->workerCount = workerCount;
+    for (int i = 0; i < workerCount; i++) {
+        PoolWorker *worker = (PoolWorker *)malloc(sizeof(PoolWorker));
+        if (worker != NULL) {
+            worker->pool = pool;
+            worker->index = i;
+        }
+        if (worker == NULL || pthread_create(&pool->threads[i], NULL, pool_worker, worker) != 0) {
+            free(worker);
+            break;
+        }
+        pool->threadCount++;
+    }
+    if (pool->threadCount == 0) {
+        pool_stop(pool);
+        return -1;
+    }
+    return 0;
+}
+
+/* Prints per-task text in task order as soon as every earlier task has published. */
+typedef struct {
+    pthread_mutex_t lock;
+    char **texts;
+    size_t *lengths;
+    uint8_t *ready;
+    int count;
+    int capacity;
+    int nextToPrint;
+} OrderedOutput;
+
+static void ordered_output_init(OrderedOutput *output) {
+    memset(output, 0, sizeof(*output));
+    pthread_mutex_init(&output->lock, NULL);
+}
+
+/* Registers one more task and returns its slot, or -1 when out of memory. */
+static int ordered_output_add(OrderedOutput *output) {
+    pthread_mutex_lock(&output->lock);
+    if (output->count == output->capacity) {
+        int capacity = output->capacity ? output->capacity * 2 : 64;
+        char **texts = (char **)realloc(output->texts, capacity * sizeof(char *));
+        if (texts != NULL) {
+            output->texts = texts;
+        }
+        size_t *lengths = texts ? (size_t *)realloc(output->lengths, capacity * sizeof(size_t)) : NULL;
+        if (lengths != NULL) {
+            output->lengths = lengths;
+        }
+        uint8_t *ready = lengths ? (uint8_t *)realloc(output->ready, capacity) : NULL;
+        if (ready == NULL) {
+            pthread_mutex_unlock(&output->lock);
+            return -1;
+        }
+        memset(ready + output->capacity, 0, capacity - output->capacity);
+        output->ready = ready;
+        output->capacity = capacity;
+    }
+    int index = output->count++;
+    pthread_mutex_unlock(&output->lock);
+    return index;
+}
+
+static void ordered_output_publish(OrderedOutput *output, int index, char *text, size_t length) {
+    pthread_mutex_lock(&output->lock);
+    output->texts[index] = text;
+    output->lengths[index] = length;
+    output->ready[index] = 1;
+    while (output->nextToPrint < output->count && output->ready[output->nextToPrint]) {
+        int next = output->nextToPrint++;
+        if (output->lengths[next] > 0) {
+            fwrite(output->texts[next], 1, output->lengths[next], stdout);
+        }
+        free(output->texts[next]);
+        output->texts[next] = NULL;
+    }
+    pthread_mutex_unlock(&output->lock);
+}
+
+static void ordered_output_destroy(OrderedOutput *output) {
+    fflush(stdout);
+    pthread_mutex_destroy(&output->lock);
+    free(output->texts);
+    free(output->lengths);
+    free(output->ready);
+}
+
+/*
+ * Result sink: every per-file result goes through these helpers. Text keeps
+ * the historical lines, ndjson writes one object per line, and binary writes
+ * records of { u8 type, u8 tag, u16 fileLength, u32 payloadLength } followed by
+ * the file name and payload, all little-endian. The tag is N for xor records,
+ * the checksum kind for checksum records and 0 for everything else.
+ */
+enum { RECORD_XOR = 1, RECORD_MASK_MATCH, RECORD_MASK_COUNT, RECORD_FIND_MATCH, RECORD_ERROR, RECORD_COPY_FAILURES, RECORD_MASK_HISTOGRAM,
+       RECORD_FIND_OFFSET, RECORD_FIND_COUNT, RECORD_CHECKSUM, RECORD_DUPLICATE, RECORD_MASK_INDEX,
+       RECORD_HARD_LINK };
+
+static void put_le(uint8_t *out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) {
+        out[i] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+static void result_binary(FILE *out, int type, int tag, const char *file, const void *payload, size_t payloadLength) {
+    size_t fileLength = file ? strlen(file) : 0;
+    uint8_t header[8] = { (uint8_t)type, (uint8_t)tag };
+    if (fileLength > UINT16_MAX) {
+        fileLength = UINT16_MAX;
+    }
+    put_le(header + 2, fileLength, 2);
+    put_le(header + 4, payloadLength, 4);
+    fwrite(header, 1, sizeof(header), out);
+    fwrite(file, 1, fileLength, out);
+    fwrite(payload, 1, payloadLength, out);
+}
+
+static void json_string(FILE *out, const char *text) {
+    putc('"', out);
+    for (const unsigned char *c = (const unsigned char *)text; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(out, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(out, "\\u%04x", *c);
+        } else {
+            putc(*c, out);
+        }
+    }
+    putc('"', out);
+}
+
+static void json_record(FILE *out, const char *type, const char *file) {
+    fprintf(out, "{\"type\":\"%s\"", type);
+    if (file != NULL) {
+        fputs(",\"file\":", out);
+        json_string(out, file);
+    }
+}
+
+/* value holds the reduced block; xor2 passes its single nibble. multi labels text lines with N. */
+static void result_xor(FILE *out, const char *file, int N, const uint8_t *value, size_t length, int multi) {
+    if (options.format == FORMAT_BINARY) {
+        result_binary(out, RECORD_XOR, N, file, value, length);
+        return;
+    }
+    if (options.format == FORMAT_NDJSON) {
+        json_record(out, "xor", file);
+        fprintf(out, ",\"n\":%d,\"value\":\"", N);
+    } else if (multi) {
+        fprintf(out, "Computed XOR%d for %s: ", N, file);
+    } else {
+        fprintf(out, "Computed XOR for %s: ", file);
+    }
+    if (N == 2) {
+        fprintf(out, "%01x", value[0] & 0x0F);
+    } else {
+        /* wide blocks run to megabytes of hex, so skip printf per byte */
+        static const char hexDigits[] = "0123456789abcdef";
+        for (size_t i = 0; i < length; i++) {
+            putc(hexDigits[value[i] >> 4], out);
+            putc(hexDigits[value[i] & 0x0F], out);
+        }
+    }
+    fputs(options.format == FORMAT_NDJSON ? "\"}\n" : "\n", out);
+}
+
+/* mask mode values print with as many hex digits as the word width */
+static void result_mask_begin(FILE *out, const char *file, uint64_t mask) {
+    if (options.format == FORMAT_TEXT) {
+        fprintf(out, "Checking file %s with mask: 0x%0*llX\n", file, options.wordBits / 4, (unsigned long long)mask);
+    }
+}
+
+static void result_mask_set_begin(FILE *out, const char *file, int maskCount) {
+    if (options.format == FORMAT_TEXT) {
+        fprintf(out, "Checking file %s with %d masks\n", file, maskCount);
+    }
+}
+
+static void result_mask_match(FILE *out, const char *file, uint64_t value, uint64_t mask, uint64_t offset) {
+    int digits = options.wordBits / 4;
+    if (options.format == FORMAT_BINARY) {
+        uint8_t payload[24];
+        put_le(payload, value, 8);
+        put_le(payload + 8, mask, 8);
+        put_le(payload + 16, offset, 8);
+        result_binary(out, RECORD_MASK_MATCH, 0, file, payload, sizeof(payload));
+    } else if (options.format == FORMAT_NDJSON) {
+        json_record(out, "mask_match", file);
+        fprintf(out, ",\"value\":%llu,\"mask\":%llu,\"offset\":%llu}\n",
+                (unsigned long long)value, (unsigned long long)mask, (unsigned long long)offset);
+    } else if (options.maskListLimit == UINT64_MAX) {
+        fprintf(out, "Value: 0x%0*llX, Mask: 0x%0*llX\n", digits, (unsigned long long)value,
+                digits, (unsigned long long)mask);
+    } else {
+        fprintf(out, "Value: 0x%0*llX, Mask: 0x%0*llX, Offset: %llu\n", digits, (unsigned long long)value,
+                digits, (unsigned long long)mask, (unsigned long long)offset);
+    }
+}
+
+/* multi marks a mask-set run, whose text lines have to name the mask */
+static void result_mask_count(FILE *out, const char *file, uint64_t mask, uint64_t count, int multi) {
+    if (options.format == FORMAT_BINARY) {
+        uint8_t payload[16];
+        put_le(payload, mask, 8);
+        put_le(payload + 8, count, 8);
+        result_binary(out, RECORD_MASK_COUNT, 0, file, payload, sizeof(payload));
+    } else if (options.format == FORMAT_NDJSON) {
+        json_record(out, "mask_count", file);
+        fprintf(out, ",\"mask\":%llu,\"count\":%llu}\n", (unsigned long long)mask, (unsigned long long)count);
+    } else if (multi) {
+        fprintf(out, "found %llu matches for mask 0x%0*llX in %s\n", (unsigned long long)count,
+                options.wordBits / 4, (unsigned long long)mask, file);
+    } else {
+        fprintf(out, "found %llu matches in %s\n", (unsigned long long)count, file);
+    }
+}
+
+static void result_mask_index(FILE *out, const char *file, uint64_t words, uint64_t indexBytes) {
+    if (options.format == FORMAT_BINARY) {
+        uint8_t payload[16];
+        put_le(payload, words, 8);
+        put_le(payload + 8, indexBytes, 8);
+        result_binary(out, RECORD_MASK_INDEX, 0, file, payload, sizeof(payload));
+    } else if (options.format == FORMAT_NDJSON) {
+        json_record(out, "mask_index", file);
+        fprintf(out, ",\"words\":%llu,\"bytes\":%llu}\n", (unsigned long long)words, (unsigned long long)indexBytes);
+    } else {
+        fprintf(out, "Indexed %llu words of %s (%llu index bytes)\n", (unsigned long long)words, file,
+                (unsigned long long)indexBytes);
+    }
+}
+
+/* bits[b] counts matching words with bit b set; text lists the busiest bits first */
+static void result_mask_histogram(FILE *out, const char *file, const uint64_t bits[32]) {
+    if (options.format == FORMAT_BINARY) {
+        uint8_t payload[32 * 8];
+        for (int b = 0; b < 32; b++) {
+            put_le(payload + b * 8, bits[b], 8);
+        }
+        result_binary(out, RECORD_MASK_HISTOGRAM, 0, file, payload, sizeof(payload));
+        return;
+    }
+    if (options.format == FORMAT_NDJSON) {
+        json_record(out, "mask_histogram", file);
+        fputs(",\"bits\":[", out);
+        for (int b = 0; b < 32; b++) {
+            fprintf(out, b ? ",%llu" : "%llu", (unsigned long long)bits[b]);
+        }
+        fputs("]}\n", out);
+        return;
+    }
+    int order[32];
+    for (int b = 0; b < 32; b++) {
+        int at = b;
+        for (; at > 0 && bits[order[at - 1]] < bits[b]; at--) {
+            order[at] = order[at - 1];
+        }
+        order[at] = b;
+    }
+    fprintf(out, "Bit histogram of matching words in %s:\n", file);
+    for (int i = 0; i < 32 && bits[order[i]] > 0; i++) {
+        fprintf(out, "bit %2d: %llu\n", order[i], (unsigned long long)bits[order[i]]);
+    }
+}
+
+/* find --all: one record per match, then the per-file total */
+static void result_find_offset(FILE *out, const char *file, const char *pattern, uint64_t offset) {
+    if (options.format == FORMAT_BINARY) {
+        size_t patternLength = pattern ? strlen(pattern) : 0;
+        uint8_t payload[8 + 256];
+        if (patternLength > 256) {
+            patternLength = 256;
+        }
+        put_le(payload, offset, 8);
+        memcpy(payload + 8, pattern, patternLength);
+        result_binary(out, RECORD_FIND_OFFSET, 0, file, payload, 8 + patternLength);
+    } else if (options.format == FORMAT_NDJSON) {
+        json_record(out, "find", file);
+        if (pattern != NULL) {
+            fputs(",\"pattern\":", out);
+            json_string(out, pattern);
+        }
+        fprintf(out, ",\"offset\":%llu}\n", (unsigned long long)offset);
+    } else if (pattern != NULL) {
+        fprintf(out, "Match of '%s' at offset %llu in: %s\n", pattern, (unsigned long long)offset, file);
+    } else {
+        fprintf(out, "Match at offset %llu in: %s\n", (unsigned long long)offset, file);
+    }
+}
+
+static void result_find_count(FILE *out, const char *file, uint64_t count) {
+    if (options.format == FORMAT_BINARY) {
+        uint8_t payload[8];
+        put_le(payload, count, 8);
+        result_binary(out, RECORD_FIND_COUNT, 0, file, payload, sizeof(payload));
+    } else if (options.format == FORMAT_NDJSON) {
+        json_record(out, "find_count", file);
+        fprintf(out, ",\"count\":%llu}\n", (unsigned long long)count);
+    } else {
+        fprintf(out, "found %llu matches in %s\n", (unsigned long long)count, file);
+    }
+}
+
+/* checksum is one of the CHECKSUM_* kinds, which is also the binary tag */
+static void result_checksum(FILE *out, const char *file, int checksum, uint64_t value) {
+    int bytes = checksum == CHECKSUM_CRC32C ? 4 : 8;
+    const char *name = checksum == CHECKSUM_CRC32C ? "crc32c" : "xxh64";
+    if (options.format == FORMAT_BINARY) {
+        uint8_t payload[8];
+        put_le(payload, value, bytes);
+        result_binary(out, RECORD_CHECKSUM, checksum, file, payload, (size_t)bytes);
+    } else if (options.format == FORMAT_NDJSON) {
+        json_record(out, name, file);
+        fprintf(out, ",\"value\":\"%0*llx\"}\n", 2 * bytes, (unsigned long long)value);
+    } else {
+        fprintf(out, "Computed %s for %s: %0*llx\n", checksum == CHECKSUM_CRC32C ? "CRC32C" : "XXH64", file,
+                2 * bytes, (unsigned long long)value);
+    }
+}
+
+/* pattern is NULL for a single-pattern search */
+static void result_find(FILE *out, const char *file, const char *pattern) {
+    if (options.format == FORMAT_BINARY) {
+        result_binary(out, RECORD_FIND_MATCH, 0, file, pattern, pattern ? strlen(pattern) : 0);
+    } else if (options.format == FORMAT_NDJSON) {
+        json_record(out, "find", file);
+        if (pattern != NULL) {
+            fputs(",\"pattern\":", out);
+            json_string(out, pattern);
+        }
+        fputs("}\n", out);
+    } else if (pattern != NULL) {
+        fprintf(out, "Match of '%s' located in: %s\n", pattern, file);
+    } else {
+        fprintf(out, "Match located in: %s\n", file);
+    }
+}
+
+/* One group of identical files; binary output writes a record per file with the group number and size. */
+static void result_duplicates(FILE *out, uint32_t group, uint64_t size, char *const *files, size_t count) {
+    if (options.format == FORMAT_BINARY) {
+        uint8_t payload[12];
+        put_le(payload, group, 4);
+        put_le(payload + 4, size, 8);
+        for (size_t i = 0; i < count; i++) {
+            result_binary(out, RECORD_DUPLICATE, 0, files[i], payload, sizeof(payload));
+        }
+    } else if (options.format == FORMAT_NDJSON) {
+        json_record(out, "duplicates", NULL);
+        fprintf(out, ",\"size\":%llu,\"files\":[", (unsigned long long)size);
+        for (size_t i = 0; i < count; i++) {
+            if (i > 0) {
+                putc(',', out);
+            }
+            json_string(out, files[i]);
+        }
+        fputs("]}\n", out);
+    } else {
+        fprintf(out, "Identical files (%llu bytes each):\n", (unsigned long long)size);
+        for (size_t i = 0; i < count; i++) {
+            fprintf(out, "  %s\n", files[i]);
+        }
+    }
+}
+
+/* Names of one inode; dedupe lists them apart because removing one of them frees nothing. */
+static void result_hard_links(FILE *out, uint32_t group, uint64_t size, char *const *files, size_t count) {
+    if (options.format == FORMAT_BINARY) {
+        uint8_t payload[12];
+        put_le(payload, group, 4);
+        put_le(payload + 4, size, 8);
+        for (size_t i = 0; i < count; i++) {
+            result_binary(out, RECORD_HARD_LINK, 0, files[i], payload, sizeof(payload));
+        }
+    } else if (options.format == FORMAT_NDJSON) {
+        json_record(out, "hard_links", NULL);
+        fprintf(out, ",\"size\":%llu,\"files\":[", (unsigned long long)size);
+        for (size_t i = 0; i < count; i++) {
+            if (i > 0) {
+                putc(',', out);
+            }
+            json_string(out, files[i]);
+        }
+        fputs("]}\n", out);
+    } else {
+        fprintf(out, "Hard links to one file (%llu bytes):\n", (unsigned long long)size);
+        for (size_t i = 0; i < count; i++) {
+            fprintf(out, "  %s\n", files[i]);
+        }
+    }
+}
+
+static void result_copy_failures(FILE *out, int failures) {
+    if (options.format == FORMAT_BINARY) {
+        uint8_t payload[4];
+        put_le(payload, (uint32_t)failures, 4);
+        result_binary(out, RECORD_COPY_FAILURES, 0, NULL, payload, sizeof(payload));
+    } else if (options.format == FORMAT_NDJSON) {
+        json_record(out, "copy_failures", NULL);
+        fprintf(out, ",\"count\":%d}\n", failures);
+    } else {
+        fprintf(out, "Some copy operations failed (%d failures)\n", failures);
+    }
+}
+
+/* textFormat is the historical text line with one %s for the file */
+static void result_error(FILE *out, const char *file, const char *textFormat) {
+    if (options.format == FORMAT_TEXT) {
+        fprintf(out, textFormat, file);
+        return;
+    }
+    char message[PATH_MAX + 128];
+    int length = snprintf(message, sizeof(message), textFormat, file);
+    if (length >= (int)sizeof(message)) {
+        length = (int)sizeof(message) - 1;
+    }
+    while (length > 0 && message[length - 1] == '\n') {
+        message[--length] = '\0';
+    }
+    if (options.format == FORMAT_BINARY) {
+        result_binary(out, RECORD_ERROR, 0, file, message, (size_t)length);
+    } else {
+        json_record(out, "error", file);
+        fputs(",\"message\":", out);
+        json_string(out, message);
+        fputs("}\n", out);
+    }
+}
+
+/* Include/exclude filters for files found under directory inputs, matched against the entry name. */
+typedef struct {
+    const char *items[MAX_GLOBS];
+    int count;
+} GlobList;
+
+static GlobList includeGlobs;
+static GlobList excludeGlobs;
+
+static int glob_list_add(GlobList *list, const char *glob) {
+    if (list->count == MAX_GLOBS) {
+        printf("Too many glob filters\n");
+        return -1;
+    }
+    list->items[list->count++] = glob;
+    return 0;
+}
+
+static int glob_list_match(const GlobList *list, const char *name) {
+    for (int i = 0; i < list->count; i++) {
+        if (fnmatch(list->items[i], name, 0) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Input paths of a run. Explicit paths are queued in argument order, then
+ * directories are walked with getdents64 by tasks on a worker pool; each
+ * file is queued as soon as it is seen, so consumers start long before the
+ * walk ends. Symlinks and special files under a directory are skipped and
+ * the filters are applied before anything is opened.
+ */
+/* One segment per input, so paths come out in argv order even while later directories are still being walked. */
+typedef struct {
+    char **items;
+    size_t count;
+    size_t capacity;
+    size_t next;
+    int walkers;
+} FeedSegment;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    FeedSegment *segments;
+    int segmentCount;
+    int current;
+    int walkers;
+    int walkLimit;
+    WorkerPool *pool;
+    WorkerPool ownPool;
+    int ownsPool;
+} PathFeed;
+
+typedef struct {
+    PathFeed *feed;
+    FeedSegment *segment;
+    int dirFd;
+    char *path;
+} WalkTask;
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static int is_directory_input(const char *path) {
+    struct stat st;
+    return strcmp(path, "-") != 0 && stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static int has_directory_input(int count, char *inputs[]) {
+    for (int i = 0; i < count; i++) {
+        if (is_directory_input(inputs[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Takes ownership of path. */
+static void path_feed_push(PathFeed *feed, FeedSegment *segment, char *path) {
+    pthread_mutex_lock(&feed->lock);
+    if (segment->count == segment->capacity) {
+        size_t capacity = segment->capacity ? segment->capacity * 2 : 16;
+        char **items = (char **)realloc(segment->items, capacity * sizeof(char *));
+        if (items == NULL) {
+            pthread_mutex_unlock(&feed->lock);
+            printf("Cannot allocate memory for %s\n", path);
+            free(path);
+            return;
+        }
+        segment->items = items;
+        segment->capacity = capacity;
+    }
+    segment->items[segment->count++] = path;
+    pthread_cond_signal(&feed->ready);
+    pthread_mutex_unlock(&feed->lock);
+}
+
+/* Walkers run on pool threads, so keep each error record in one piece on stdout. */
+static void walk_error(const char *path, const char *textFormat) {
+    flockfile(stdout);
+    result_error(stdout, path, textFormat);
+    funlockfile(stdout);
+}
+
+static void path_feed_walk(PathFeed *feed, FeedSegment *segment, int dirFd, char *path);
+
+static void walk_directory(PathFeed *feed, FeedSegment *segment, int dirFd, const char *path) {
+    uint8_t buffer[32768] __attribute__((aligned(8)));
+    size_t pathLength = strlen(path);
+    int slash = pathLength > 0 && path[pathLength - 1] == '/';
+    long bytes;
+    while ((bytes = syscall(SYS_getdents64, dirFd, buffer, sizeof(buffer))) > 0) {
+        for (long at = 0; at < bytes;) {
+            struct linux_dirent64 *entry = (struct linux_dirent64 *)(buffer + at);
+            at += entry->d_reclen;
+            const char *name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            unsigned type = entry->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+                if (fstatat(dirFd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                    continue;
+                }
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+            if ((type != DT_DIR && type != DT_REG) || glob_list_match(&excludeGlobs, name) ||
+                (type == DT_REG && includeGlobs.count > 0 && !glob_list_match(&includeGlobs, name))) {
+                continue;
+            }
+            size_t nameLength = strlen(name);
+            char *child = (char *)malloc(pathLength + nameLength + 2);
+            if (child == NULL) {
+                continue;
+            }
+            memcpy(child, path, pathLength);
+            if (!slash) {
+                child[pathLength] = '/';
+            }
+            memcpy(child + pathLength + !slash, name, nameLength + 1);
+            if (type == DT_REG) {
+                path_feed_push(feed, segment, child);
+                continue;
+            }
+            int childFd = openat(dirFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (childFd < 0) {
+                walk_error(child, "Cannot open directory %s\n");
+                free(child);
+                continue;
+            }
+            path_feed_walk(feed, segment, childFd, child);
+        }
+    }
+    if (bytes < 0) {
+        walk_error(path, "Cannot read directory %s\n");
+    }
+}
+
+static void walk_done(PathFeed *feed, FeedSegment *segment, int dirFd, char *path) {
+    close(dirFd);
+    free(path);
+    pthread_mutex_lock(&feed->lock);
+    feed->walkers--;
+    if (--segment->walkers == 0) {
+        pthread_cond_broadcast(&feed->ready);
+    }
+    pthread_mutex_unlock(&feed->lock);
+}
+
+static void walk_task_entry(void *arg) {
+    WalkTask *task = (WalkTask *)arg;
+    walk_directory(task->feed, task->segment, task->dirFd, task->path);
+    walk_done(task->feed, task->segment, task->dirFd, task->path);
+    free(task);
+}
+
+/* Walks dirFd on the pool, or inline once walkLimit walks (each holding an open directory) are queued. */
+static void path_feed_walk(PathFeed *feed, FeedSegment *segment, int dirFd, char *path) {
+    pthread_mutex_lock(&feed->lock);
+    int queued = feed->walkers++;
+    segment->walkers++;
+    pthread_mutex_unlock(&feed->lock);
+    WalkTask *task = feed->pool && queued < feed->walkLimit ? (WalkTask *)malloc(sizeof(WalkTask)) : NULL;
+    if (task != NULL) {
+        task->feed = feed;
+        task->segment = segment;
+        task->dirFd = dirFd;
+        task->path = path;
+        if (pool_submit(feed->pool, walk_task_entry, task) == 0) {
+            return;
+        }
+        free(task);
+    }
+    walk_directory(feed, segment, dirFd, path);
+    walk_done(feed, segment, dirFd, path);
+}
+
+/* pool may be NULL; a private one is started when there is a directory to walk. */
+static void path_feed_start(PathFeed *feed, int count, char *inputs[], WorkerPool *pool) {
+    memset(feed, 0, sizeof(*feed));
+    pthread_mutex_init(&feed->lock, NULL);
+    pthread_cond_init(&feed->ready, NULL);
+    feed->pool = pool;
+    feed->segments = (FeedSegment *)calloc(count > 0 ? (size_t)count : 1, sizeof(FeedSegment));
+    if (feed->segments == NULL) {
+        printf("Cannot allocate memory for the input list\n");
+        return;
+    }
+    feed->segmentCount = count;
+    /* queued walks keep their directory open, so leave most descriptors to the modes */
+    struct rlimit limit;
+    feed->walkLimit = WALK_TASK_LIMIT;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur / 4 < WALK_TASK_LIMIT) {
+        feed->walkLimit = limit.rlim_cur / 4 > 0 ? (int)(limit.rlim_cur / 4) : 1;
+    }
+    for (int i = 0; i < count; i++) {
+        FeedSegment *segment = &feed->segments[i];
+        if (!is_directory_input(inputs[i])) {
+            path_feed_push(feed, segment, strdup(inputs[i]));
+            continue;
+        }
+        if (feed->pool == NULL && !feed->ownsPool && pool_start(&feed->ownPool, worker_count(INT_MAX)) == 0) {
+            feed->ownsPool = 1;
+            feed->pool = &feed->ownPool;
+        }
+        int fd = open(inputs[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+            /* queued as a file so the mode reports it like any unreadable input */
+            path_feed_push(feed, segment, strdup(inputs[i]));
+        } else {
+            path_feed_walk(feed, segment, fd, strdup(inputs[i]));
+        }
+    }
+}
+
+/* Blocks until the next path in argv order is queued; returns NULL once every walk is over and the queue is drained. */
+static const char *path_feed_next(PathFeed *feed) {
+    const char *path = NULL;
+    pthread_mutex_lock(&feed->lock);
+    while (feed->current < feed->segmentCount) {
+        FeedSegment *segment = &feed->segments[feed->current];
+        if (segment->next < segment->count) {
+            path = segment->items[segment->next++];
+            break;
+        }
+        if (segment->walkers == 0) {
+            feed->current++;
+            continue;
+        }
+        pthread_cond_wait(&feed->ready, &feed->lock);
+    }
+    pthread_mutex_unlock(&feed->lock);
+    return path;
+}
+
+/* Waits for the walk to finish without consuming anything. */
+static void path_feed_drain(PathFeed *feed) {
+    pthread_mutex_lock(&feed->lock);
+    while (feed->walkers > 0) {
+        pthread_cond_wait(&feed->ready, &feed->lock);
+    }
+    pthread_mutex_unlock(&feed->lock);
+}
+
+static void path_feed_destroy(PathFeed *feed) {
+    path_feed_drain(feed);
+    if (feed->ownsPool) {
+        pool_stop(&feed->ownPool);
+    }
+    for (int s = 0; s < feed->segmentCount; s++) {
+        for (size_t i = 0; i < feed->segments[s].count; i++) {
+            free(feed->segments[s].items[i]);
+        }
+        free(feed->segments[s].items);
+    }
+    free(feed->segments);
+    pthread_mutex_destroy(&feed->lock);
+    pthread_cond_destroy(&feed->ready);
+}
+
+/*
+ * Per-file job: run(job, path, out) handles one input file on the pool and
+ * writes its report to out. files are the command line inputs, expanded
+ * through a PathFeed. cancelled is raised once --any has its answer; long
+ * scans poll it between chunks. listFirst makes the whole tree be listed
+ * before the first task runs, for modes that create files next to inputs.
+ */
+typedef struct FileJob FileJob;
+
+struct FileJob {
+    char **files;
+    void (*run)(FileJob *job, const char *path, FILE *out);
+    void *context;
+    int listFirst;
+    OrderedOutput output;
+    int failures;
+    int matches;
+    int cancelled;
+};
+
+typedef struct {
+    FileJob *job;
+    const char *path;
+    int index;
+} FileTask;
+
+static int job_cancelled(const FileJob *job) {
+    return __atomic_load_n(&job->cancelled, __ATOMIC_RELAXED);
+}
+
+static void file_task_entry(void *arg) {
+    FileTask *task = (FileTask *)arg;
+    /* --any already has its answer: queued files are skipped without being opened */
+    if (job_cancelled(task->job)) {
+        ordered_output_publish(&task->job->output, task->index, NULL, 0);
+        free(task);
+        return;
+    }
+    char *text = NULL;
+    size_t length = 0;
+    FILE *out = open_memstream(&text, &length);
+    if (out == NULL) {
+        __atomic_fetch_add(&task->job->failures, 1, __ATOMIC_RELAXED);
+        ordered_output_publish(&task->job->output, task->index, NULL, 0);
+        free(task);
+        return;
+    }
+    task->job->run(task->job, task->path, out);
+    if (options.stopOnMatch && __atomic_load_n(&task->job->matches, __ATOMIC_RELAXED) > 0) {
+        __atomic_store_n(&task->job->cancelled, 1, __ATOMIC_RELAXED);
+    }
+    fclose(out);
+    ordered_output_publish(&task->job->output, task->index, text, length);
+    free(task);
+}
+
+/*
+ * Process-isolated variant of run_file_tasks: every file runs in a child
+ * that writes its report to a memfd and returns (failures << 1) | matched
+ * as exit status. Children are supervised through pidfds in one epoll set,
+ * so each one is reaped as soon as it exits.
+ */
+typedef struct {
+    pid_t pid;
+    int pidfd;
+    int reportFd;
+    int index;
+} ChildSlot;
+
+static int pidfd_open_child(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static void kill_child(const ChildSlot *slot) {
+#ifdef SYS_pidfd_send_signal
+    if (slot->pidfd >= 0 && syscall(SYS_pidfd_send_signal, slot->pidfd, SIGKILL, NULL, 0) == 0) {
+        return;
+    }
+#endif
+    kill(slot->pid, SIGKILL);
+}
+
+static int spawn_file_child(FileJob *job, int index, const char *path, ChildSlot *slot, int epollFd) {
+    slot->reportFd = memfd_create("report", MFD_CLOEXEC);
+    if (slot->reportFd < 0) {
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(slot->reportFd);
+        return -1;
+    }
+    if (pid == 0) {
+        char *text = NULL;
+        size_t length = 0;
+        FILE *out = open_memstream(&text, &length);
+        if (out == NULL) {
+            _exit(2);
+        }
+        job->failures = 0;
+        job->matches = 0;
+        job->run(job, path, out);
+        fclose(out);
+        write_all(slot->reportFd, (const uint8_t *)text, length);
+        int failures = job->failures > 127 ? 127 : job->failures;
+        _exit((failures << 1) | (job->matches > 0));
+    }
+    slot->pid = pid;
+    slot->index = index;
+    slot->pidfd = -1;
+    if (epollFd >= 0) {
+        slot->pidfd = pidfd_open_child(pid);
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = slot };
+        if (slot->pidfd >= 0 && epoll_ctl(epollFd, EPOLL_CTL_ADD, slot->pidfd, &event) != 0) {
+            close(slot->pidfd);
+            slot->pidfd = -1;
+        }
+    }
+    return 0;
+}
+
+static void reap_file_child(FileJob *job, ChildSlot *slot, int epollFd, int status, int cancelled) {
+    char *text = NULL;
+    off_t length = lseek(slot->reportFd, 0, SEEK_END);
+    if (!cancelled && length > 0 && (text = (char *)malloc((size_t)length)) != NULL &&
+        pread(slot->reportFd, text, (size_t)length, 0) != length) {
+        free(text);
+        text = NULL;
+    }
+    if (cancelled) {
+        /* killed on purpose: the report is dropped and not counted as a failure */
+    } else if (WIFEXITED(status)) {
+        job->failures += WEXITSTATUS(status) >> 1;
+        job->matches += WEXITSTATUS(status) & 1;
+    } else {
+        job->failures++;
+    }
+    ordered_output_publish(&job->output, slot->index, text, text ? (size_t)length : 0);
+    if (slot->pidfd >= 0) {
+        /* later children inherited this pidfd, so closing it alone would not leave the epoll set */
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, slot->pidfd, NULL);
+        close(slot->pidfd);
+    }
+    close(slot->reportFd);
+    slot->pid = 0;
+}
+
+static int run_isolated_tasks(FileJob *job, PathFeed *feed, int limit) {
+    ChildSlot *slots = (ChildSlot *)calloc(limit, sizeof(ChildSlot));
+    struct epoll_event *events = (struct epoll_event *)calloc(limit, sizeof(struct epoll_event));
+    if (slots == NULL || events == NULL) {
+        printf("Cannot allocate memory for process slots\n");
+        free(slots);
+        free(events);
+        return -1;
+    }
+
+    /* without pidfd support fall back to blocking waitpid on any child */
+    int epollFd = -1;
+    int probe = pidfd_open_child(getpid());
+    if (probe >= 0) {
+        close(probe);
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+    }
+
+    /* an inherited SIG_IGN would let the kernel reap children before waitpid sees them */
+    signal(SIGCHLD, SIG_DFL);
+    fflush(stdout);
+    const char *path = path_feed_next(feed);
+    int running = 0;
+    int cancelled = 0;
+    while (path != NULL || running > 0) {
+        for (int s = 0; s < limit && !cancelled && path != NULL; s++) {
+            if (slots[s].pid != 0) {
+                continue;
+            }
+            int index = ordered_output_add(&job->output);
+            if (index < 0 || spawn_file_child(job, index, path, &slots[s], epollFd) != 0) {
+                printf("Process creation failed\n");
+                job->failures++;
+                if (index >= 0) {
+                    ordered_output_publish(&job->output, index, NULL, 0);
+                }
+            } else {
+                running++;
+            }
+            path = path_feed_next(feed);
+        }
+        if (running == 0) {
+            break;
+        }
+
+        int usePidfd = epollFd >= 0;
+        for (int s = 0; s < limit && usePidfd; s++) {
+            usePidfd = slots[s].pid == 0 || slots[s].pidfd >= 0;
+        }
+        if (usePidfd) {
+            int ready = epoll_wait(epollFd, events, limit, -1);
+            for (int e = 0; e < ready; e++) {
+                ChildSlot *slot = (ChildSlot *)events[e].data.ptr;
+                int status;
+                pid_t pid;
+                while ((pid = waitpid(slot->pid, &status, 0)) < 0 && errno == EINTR) {
+                }
+                if (pid < 0) {
+                    status = W_EXITCODE(0, SIGKILL);
+                }
+                reap_file_child(job, slot, epollFd, status, cancelled);
+                running--;
+            }
+        } else {
+            int status;
+            pid_t pid = waitpid(-1, &status, 0);
+            for (int s = 0; s < limit && pid > 0; s++) {
+                if (slots[s].pid == pid) {
+                    reap_file_child(job, &slots[s], epollFd, status, cancelled);
+                    running--;
+                    break;
+                }
+            }
+            if (pid < 0 && errno == ECHILD) {
+                break;
+            }
+        }
+
+        if (options.stopOnMatch && job->matches > 0 && !cancelled) {
+            cancelled = 1;
+            for (int s = 0; s < limit; s++) {
+                if (slots[s].pid != 0) {
+                    kill_child(&slots[s]);
+                }
+            }
+        }
+    }
+    if (epollFd >= 0) {
+        close(epollFd);
+    }
+    free(slots);
+    free(events);
+    return 0;
+}
+
+static int run_file_tasks(FileJob *job, int fileCount) {
+    int workers = worker_count(has_directory_input(fileCount, job->files) ? INT_MAX : fileCount);
+    PathFeed feed;
+    ordered_output_init(&job->output);
+    if (options.isolate) {
+        path_feed_start(&feed, fileCount, job->files, NULL);
+        if (job->listFirst) {
+            path_feed_drain(&feed);
+        }
+        int status = run_isolated_tasks(job, &feed, workers);
+        path_feed_destroy(&feed);
+        ordered_output_destroy(&job->output);
+        return status;
+    }
+    WorkerPool pool;
+    if (pool_start(&pool, workers) != 0) {
+        printf("Cannot start worker threads\n");
+        ordered_output_destroy(&job->output);
+        return -1;
+    }
+    fflush(stdout);
+    /* directory walks run on the same pool and feed this loop while earlier files are processed */
+    path_feed_start(&feed, fileCount, job->files, &pool);
+    if (job->listFirst) {
+        path_feed_drain(&feed);
+    }
+    const char *path;
+    while ((path = path_feed_next(&feed)) != NULL) {
+        FileTask *task = (FileTask *)malloc(sizeof(FileTask));
+        int index = task ? ordered_output_add(&job->output) : -1;
+        if (index < 0) {
+            free(task);
+            __atomic_fetch_add(&job->failures, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        task->job = job;
+        task->path = path;
+        task->index = index;
+        if (pool_submit(&pool, file_task_entry, task) != 0) {
+            __atomic_fetch_add(&job->failures, 1, __ATOMIC_RELAXED);
+            ordered_output_publish(&job->output, index, NULL, 0);
+            free(task);
+        }
+    }
+    pool_wait(&pool);
+    pool_stop(&pool);
+    path_feed_destroy(&feed);
+    ordered_output_destroy(&job->output);
+    return 0;
+}
+
+
+/*
+ * Read buffers are recycled across files instead of going back to the
+ * allocator each time. They are aligned for O_DIRECT whatever backend
+ * asked for them.
+ */
+static struct {
+    pthread_mutex_t lock;
+    uint8_t *items[IO_BUFFER_POOL];
+    size_t sizes[IO_BUFFER_POOL];
+    int count;
+} ioBuffers = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static uint8_t *io_buffer_take(size_t size) {
+    pthread_mutex_lock(&ioBuffers.lock);
+    for (int i = ioBuffers.count - 1; i >= 0; i--) {
+        if (ioBuffers.sizes[i] == size) {
+            uint8_t *buffer = ioBuffers.items[i];
+            ioBuffers.count--;
+            ioBuffers.items[i] = ioBuffers.items[ioBuffers.count];
+            ioBuffers.sizes[i] = ioBuffers.sizes[ioBuffers.count];
+            pthread_mutex_unlock(&ioBuffers.lock);
+            return buffer;
+        }
+    }
+    pthread_mutex_unlock(&ioBuffers.lock);
+    return (uint8_t *)aligned_alloc(DIRECT_IO_ALIGN, size);
+}
+
+static void io_buffer_put(uint8_t *buffer, size_t size) {
+    if (buffer == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&ioBuffers.lock);
+    if (ioBuffers.count < IO_BUFFER_POOL) {
+        ioBuffers.items[ioBuffers.count] = buffer;
+        ioBuffers.sizes[ioBuffers.count++] = size;
+        buffer = NULL;
+    }
+    pthread_mutex_unlock(&ioBuffers.lock);
+    free(buffer);
+}
+
+/*
+ * --io=direct: reads bypass the page cache with O_DIRECT. Where the file
+ * system refuses it (tmpfs, some network file systems) the file is read
+ * normally and every chunk is dropped from the cache once consumed.
+ * Returns 1 when O_DIRECT is on, 0 when only the drop-behind is.
+ */
+static int direct_io_enable(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags >= 0 && fcntl(fd, F_SETFL, flags | O_DIRECT) == 0) {
+        return 1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return 0;
+}
+
+/* O_DIRECT needs aligned offsets; a read that came back short is finished through the cache. */
+static void direct_io_disable(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags >= 0 && (flags & O_DIRECT)) {
+        fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+    }
+}
+
+/*
+ * Minimal io_uring wrapper over the raw syscalls: one submission and one
+ * completion ring mapped from the kernel, no SQ polling.
+ */
+typedef struct {
+    int fd;
+    unsigned entries;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+    void *sqRing;
+    void *cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    size_t sqesSize;
+    unsigned localTail;
+    unsigned toSubmit;
+} Uring;
+
+static int uring_init(Uring *ring, unsigned entries) {
+    memset(ring, 0, sizeof(*ring));
+#ifdef __NR_io_uring_setup
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return -1;
+    }
+    ring->entries = params.sq_entries;
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && ring->cqRingSize > ring->sqRingSize) {
+        ring->sqRingSize = ring->cqRingSize;
+    }
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    ring->cqRing = ring->sqRing;
+    if (!single) {
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cqRing == MAP_FAILED) {
+            munmap(ring->sqRing, ring->sqRingSize);
+            close(ring->fd);
+            return -1;
+        }
+    }
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        if (!single) {
+            munmap(ring->cqRing, ring->cqRingSize);
+        }
+        munmap(ring->sqRing, ring->sqRingSize);
+        close(ring->fd);
+        return -1;
+    }
+    uint8_t *sq = (uint8_t *)ring->sqRing;
+    uint8_t *cq = (uint8_t *)ring->cqRing;
+    ring->sqHead = (unsigned *)(sq + params.sq_off.head);
+    ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+    ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->localTail = *ring->sqTail;
+    return 0;
+#else
+    (void)entries;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static void uring_exit(Uring *ring) {
+    munmap(ring->sqes, ring->sqesSize);
+    if (ring->cqRing != ring->sqRing) {
+        munmap(ring->cqRing, ring->cqRingSize);
+    }
+    munmap(ring->sqRing, ring->sqRingSize);
+    close(ring->fd);
+}
+
+static int uring_register_buffers(Uring *ring, uint8_t *base, size_t bufferSize, unsigned count) {
+    struct iovec *iov = (struct iovec *)malloc(count * sizeof(struct iovec));
+    if (iov == NULL) {
+        return -1;
+    }
+    for (unsigned i = 0; i < count; i++) {
+        iov[i].iov_base = base + i * bufferSize;
+        iov[i].iov_len = bufferSize;
+    }
+    int status = (int)syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, count);
+    free(iov);
+    return status < 0 ? -1 : 0;
+}
+
+/* Returns a zeroed SQE, or NULL if the submission ring is full. */
+static struct io_uring_sqe *uring_get_sqe(Uring *ring) {
+    unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    if (ring->localTail - head >= ring->entries) {
+        return NULL;
+    }
+    unsigned index = ring->localTail & *ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqArray[index] = index;
+    ring->localTail++;
+    ring->toSubmit++;
+    return sqe;
+}
+
+/* Submits everything queued and, if waitFor > 0, blocks until that many completions are available. */
+static int uring_enter(Uring *ring, unsigned waitFor) {
+    __atomic_store_n(ring->sqTail, ring->localTail, __ATOMIC_RELEASE);
+    while (1) {
+        long submitted = syscall(__NR_io_uring_enter, ring->fd, ring->toSubmit, waitFor,
+                                 waitFor ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (submitted >= 0) {
+            ring->toSubmit -= (unsigned)submitted;
+            return 0;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+static int uring_wait_cqe(Uring *ring, struct io_uring_cqe **cqe) {
+    while (1) {
+        unsigned head = *ring->cqHead;
+        if (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+            *cqe = &ring->cqes[head & *ring->cqMask];
+            return 0;
+        }
+        if (uring_enter(ring, 1) != 0) {
+            return -1;
+        }
+    }
+}
+
+static void uring_cqe_seen(Uring *ring) {
+    __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+static void uring_prep_rw(struct io_uring_sqe *sqe, int opcode, int fd, uint8_t *buffer, size_t length,
+                          uint64_t offset, int bufferIndex, uint64_t userData) {
+    sqe->opcode = (uint8_t)(bufferIndex >= 0 ? (opcode == IORING_OP_READ ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED) : opcode);
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = (unsigned)length;
+    sqe->off = offset;
+    sqe->buf_index = (uint16_t)(bufferIndex >= 0 ? bufferIndex : 0);
+    sqe->user_data = userData;
+}
+
+/*
+ * Read-ahead state of the io_uring input backend: depth buffers (registered
+ * as fixed buffers when the memlock limit allows) with one read in flight
+ * each; chunk k always lives in slot k % depth.
+ */
+typedef struct {
+    Uring ring;
+    int fd;
+    uint8_t *buffers;
+    int depth;
+    int fixed;
+    int inFlight;
+    uint64_t size;
+    uint64_t submitOffset;
+    uint64_t chunkIndex;
+    int held;
+    int64_t *results;
+    uint8_t *done;
+    int direct;
+    int directRefused;
+} UringReader;
+
+static void uring_reader_queue(UringReader *ur, int slot) {
+    if (ur->submitOffset >= ur->size) {
+        return;
+    }
+    struct io_uring_sqe *sqe = uring_get_sqe(&ur->ring);
+    if (sqe == NULL) {
+        return;
+    }
+    uint64_t length = ur->size - ur->submitOffset;
+    if (length > INPUT_BUFFER_SIZE) {
+        length = INPUT_BUFFER_SIZE;
+    }
+    /* an O_DIRECT read of the tail asks for whole blocks and comes back short at the end of file */
+    uint64_t request = ur->direct ? (length + DIRECT_IO_ALIGN - 1) & ~(uint64_t)(DIRECT_IO_ALIGN - 1) : length;
+    uring_prep_rw(sqe, IORING_OP_READ, ur->fd, ur->buffers + (size_t)slot * INPUT_BUFFER_SIZE, (size_t)request,
+                  ur->submitOffset, ur->fixed ? slot : -1, (uint64_t)slot);
+    ur->done[slot] = 0;
+    ur->submitOffset += length;
+    ur->inFlight++;
+}
+
+static void uring_reader_free(UringReader *ur) {
+    while (ur->inFlight > 0) {
+        struct io_uring_cqe *cqe;
+        if (uring_wait_cqe(&ur->ring, &cqe) != 0) {
+            break;
+        }
+        uring_cqe_seen(&ur->ring);
+        ur->inFlight--;
+    }
+    uring_exit(&ur->ring);
+    io_buffer_put(ur->buffers, (size_t)ur->depth * INPUT_BUFFER_SIZE);
+    free(ur->results);
+    free(ur->done);
+    free(ur);
+}
+
+static UringReader *uring_reader_open(int fd, uint64_t size) {
+    UringReader *ur = (UringReader *)calloc(1, sizeof(UringReader));
+    if (ur == NULL) {
+        return NULL;
+    }
+    ur->depth = options.queueDepth;
+    if (uring_init(&ur->ring, (unsigned)ur->depth) != 0) {
+        free(ur);
+        return NULL;
+    }
+    ur->buffers = io_buffer_take((size_t)ur->depth * INPUT_BUFFER_SIZE);
+    ur->results = (int64_t *)calloc(ur->depth, sizeof(int64_t));
+    ur->done = (uint8_t *)calloc(ur->depth, 1);
+    if (ur->buffers == NULL || ur->results == NULL || ur->done == NULL) {
+        uring_reader_free(ur);
+        return NULL;
+    }
+    ur->fixed = uring_register_buffers(&ur->ring, ur->buffers, INPUT_BUFFER_SIZE, (unsigned)ur->depth) == 0;
+    ur->fd = fd;
+    ur->size = size;
+    ur->held = -1;
+    return ur;
+}
+
+/*
+ * Double-buffered read-ahead for pipes and stdin: a producer thread fills
+ * one buffer while the consumer works on the other. Buffers are filled
+ * completely unless the stream ends, like the plain stream reader.
+ */
+typedef struct {
+    pthread_t thread;
+    int fd;
+    uint8_t *buffers[2];
+    size_t lengths[2];
+    int full[2];
+    int held;
+    int next;
+    int eof;
+    int error;
+    int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} PipeReader;
+
+static void *pipe_reader_thread(void *arg) {
+    PipeReader *pr = (PipeReader *)arg;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    int slot = 0;
+    while (1) {
+        pthread_mutex_lock(&pr->lock);
+        while (!pr->stop && (pr->full[slot] || pr->held == slot)) {
+            pthread_cond_wait(&pr->changed, &pr->lock);
+        }
+        int stop = pr->stop;
+        pthread_mutex_unlock(&pr->lock);
+        if (stop) {
+            break;
+        }
+
+        size_t filled = 0;
+        int error = 0;
+        while (filled < INPUT_BUFFER_SIZE) {
+            /* only a blocking read may be cancelled, never a lock holder */
+            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+            ssize_t bytes = read(pr->fd, pr->buffers[slot] + filled, INPUT_BUFFER_SIZE - filled);
+            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+            if (bytes < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes < 0) {
+                error = errno;
+                break;
+            }
+            if (bytes == 0) {
+                break;
+            }
+            filled += (size_t)bytes;
+        }
+
+        pthread_mutex_lock(&pr->lock);
+        if (error != 0) {
+            pr->error = error;
+        } else {
+            pr->lengths[slot] = filled;
+            pr->full[slot] = 1;
+            pr->eof = filled < INPUT_BUFFER_SIZE;
+        }
+        int done = error != 0 || pr->eof;
+        pthread_cond_broadcast(&pr->changed);
+        pthread_mutex_unlock(&pr->lock);
+        if (done) {
+            break;
+        }
+        slot ^= 1;
+    }
+    return NULL;
+}
+
+static PipeReader *pipe_reader_open(int fd) {
+    PipeReader *pr = (PipeReader *)calloc(1, sizeof(PipeReader));
+    if (pr == NULL) {
+        return NULL;
+    }
+    pr->fd = fd;
+    pr->held = -1;
+    pr->buffers[0] = (uint8_t *)aligned_alloc(XOR_LANE_BYTES, INPUT_BUFFER_SIZE);
+    pr->buffers[1] = (uint8_t *)aligned_alloc(XOR_LANE_BYTES, INPUT_BUFFER_SIZE);
+    pthread_mutex_init(&pr->lock, NULL);
+    pthread_cond_init(&pr->changed, NULL);
+    if (pr->buffers[0] == NULL || pr->buffers[1] == NULL ||
+        pthread_create(&pr->thread, NULL, pipe_reader_thread, pr) != 0) {
+        pthread_mutex_destroy(&pr->lock);
+        pthread_cond_destroy(&pr->changed);
+        free(pr->buffers[0]);
+        free(pr->buffers[1]);
+        free(pr);
+        return NULL;
+    }
+    return pr;
+}
+
+static ssize_t pipe_reader_next(PipeReader *pr, const uint8_t **data) {
+    pthread_mutex_lock(&pr->lock);
+    if (pr->held >= 0) {
+        pr->full[pr->held] = 0;
+        pr->held = -1;
+        pthread_cond_broadcast(&pr->changed);
+    }
+    int slot = pr->next;
+    while (!pr->full[slot] && !pr->eof && pr->error == 0) {
+        pthread_cond_wait(&pr->changed, &pr->lock);
+    }
+    ssize_t length;
+    if (pr->full[slot]) {
+        pr->held = slot;
+        pr->next = slot ^ 1;
+        *data = pr->buffers[slot];
+        length = (ssize_t)pr->lengths[slot];
+    } else if (pr->error != 0) {
+        errno = pr->error;
+        length = -1;
+    } else {
+        length = 0;
+    }
+    pthread_mutex_unlock(&pr->lock);
+    return length;
+}
+
+static void pipe_reader_close(PipeReader *pr) {
+    pthread_mutex_lock(&pr->lock);
+    pr->stop = 1;
+    pthread_cond_broadcast(&pr->changed);
+    pthread_mutex_unlock(&pr->lock);
+    /* the producer may sit in read() on an idle pipe */
+    pthread_cancel(pr->thread);
+    pthread_join(pr->thread, NULL);
+    pthread_mutex_destroy(&pr->lock);
+    pthread_cond_destroy(&pr->changed);
+    free(pr->buffers[0]);
+    free(pr->buffers[1]);
+    free(pr);
+}
+
+/*
+ * Sequential input source. Every chunk returned by input_next except the
+ * last one is a multiple of XOR_LANE_BYTES long.
+ */
+typedef struct {
+    int fd;
+    int backend;
+    uint8_t *buffer;
+    uint8_t *map;
+    size_t mapLength;
+    int mapConsumed;
+    UringReader *uring;
+    PipeReader *pipe;
+    int direct;
+    int dropBehind;
+    uint64_t consumed;
+    size_t lastLength;
+} InputReader;
+
+/* "-" reads standard input. */
+static int input_open(InputReader *reader, const char *path, int backend) {
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = strcmp(path, "-") == 0 ? dup(STDIN_FILENO) : open(path, O_RDONLY);
+    if (reader->fd < 0) {
+        return -1;
+    }
+    reader->backend = IO_STREAM;
+
+    struct stat st;
+    if (fstat(reader->fd, &st) == 0 && (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode))) {
+        reader->pipe = pipe_reader_open(reader->fd);
+        if (reader->pipe != NULL) {
+            reader->backend = IO_PIPE;
+            return 0;
+        }
+    }
+    if (backend == IO_MMAP && fstat(reader->fd, &st) == 0 &&
+        S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+            madvise(map, (size_t)st.st_size, MADV_HUGEPAGE);
+#endif
+            reader->map = (uint8_t *)map;
+            reader->mapLength = (size_t)st.st_size;
+            reader->backend = IO_MMAP;
+            return 0;
+        }
+    }
+    if (backend == IO_DIRECT && fstat(reader->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        /* the descriptor behind - may be shared with the caller, so its flags are left alone */
+        reader->direct = strcmp(path, "-") != 0 && direct_io_enable(reader->fd);
+        reader->dropBehind = !reader->direct;
+    }
+    /* --io=direct keeps its reads in flight through io_uring as well when it can */
+    if ((backend == IO_URING || backend == IO_DIRECT) && fstat(reader->fd, &st) == 0 &&
+        S_ISREG(st.st_mode) && st.st_size > 0) {
+        reader->uring = uring_reader_open(reader->fd, (uint64_t)st.st_size);
+        if (reader->uring != NULL) {
+            reader->uring->direct = reader->direct;
+            /* the whole first window of reads goes out in one submission */
+            for (int slot = 0; slot < reader->uring->depth; slot++) {
+                uring_reader_queue(reader->uring, slot);
+            }
+            reader->backend = IO_URING;
+            return 0;
+        }
+    }
+
+    /* pipes, special files and failed mappings are streamed */
+    reader->buffer = io_buffer_take(INPUT_BUFFER_SIZE);
+    if (reader->buffer == NULL) {
+        close(reader->fd);
+        reader->fd = -1;
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+/* Hands out the next chunk in file order once its read has completed. */
+static ssize_t uring_reader_next(UringReader *ur, const uint8_t **data) {
+    if (ur->held >= 0) {
+        uring_reader_queue(ur, ur->held);
+        ur->held = -1;
+        /* hand the read to the kernel now rather than when the consumer next runs dry */
+        if (ur->ring.toSubmit > 0 && uring_enter(&ur->ring, 0) != 0) {
+            return -1;
+        }
+    }
+    uint64_t offset = ur->chunkIndex * INPUT_BUFFER_SIZE;
+    if (offset >= ur->size) {
+        return 0;
+    }
+    int slot = (int)(ur->chunkIndex % (uint64_t)ur->depth);
+    while (!ur->done[slot]) {
+        struct io_uring_cqe *cqe;
+        if (uring_wait_cqe(&ur->ring, &cqe) != 0) {
+            return -1;
+        }
+        ur->results[cqe->user_data] = cqe->res;
+        ur->done[cqe->user_data] = 1;
+        ur->inFlight--;
+        uring_cqe_seen(&ur->ring);
+    }
+    /* a filesystem can take F_SETFL O_DIRECT and still refuse the reads; those, and the ones already queued, are redone below */
+    if (ur->results[slot] == -EINVAL && (ur->direct || ur->directRefused)) {
+        direct_io_disable(ur->fd);
+        ur->direct = 0;
+        ur->directRefused = 1;
+        ur->results[slot] = 0;
+    }
+    if (ur->results[slot] < 0) {
+        errno = (int)-ur->results[slot];
+        return -1;
+    }
+
+    uint8_t *buffer = ur->buffers + (size_t)slot * INPUT_BUFFER_SIZE;
+    size_t expected = ur->size - offset < INPUT_BUFFER_SIZE ? (size_t)(ur->size - offset) : INPUT_BUFFER_SIZE;
+    size_t filled = (size_t)ur->results[slot] < expected ? (size_t)ur->results[slot] : expected;
+    /* short reads are completed synchronously; a file that shrank ends the stream here */
+    while (filled < expected) {
+        ssize_t bytes = pread(ur->fd, buffer + filled, expected - filled, (off_t)(offset + filled));
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes < 0 && errno == EINVAL && ur->direct) {
+            direct_io_disable(ur->fd);
+            ur->direct = 0;
+            continue;
+        }
+        if (bytes < 0) {
+            return -1;
+        }
+        if (bytes == 0) {
+            ur->size = offset + filled;
+            break;
+        }
+        filled += (size_t)bytes;
+    }
+    ur->held = slot;
+    ur->chunkIndex++;
+    *data = buffer;
+    return (ssize_t)filled;
+}
+
+static ssize_t input_next_chunk(InputReader *reader, const uint8_t **data) {
+    if (reader->backend == IO_MMAP) {
+        if (reader->mapConsumed) {
+            return 0;
+        }
+        reader->mapConsumed = 1;
+        *data = reader->map;
+        return (ssize_t)reader->mapLength;
+    }
+    if (reader->backend == IO_URING) {
+        return uring_reader_next(reader->uring, data);
+    }
+    if (reader->backend == IO_PIPE) {
+        return pipe_reader_next(reader->pipe, data);
+    }
+
+    size_t filled = 0;
+    while (filled < INPUT_BUFFER_SIZE) {
+        ssize_t bytes = read(reader->fd, reader->buffer + filled, INPUT_BUFFER_SIZE - filled);
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EINVAL && reader->direct) {
+                direct_io_disable(reader->fd);
+                reader->direct = 0;
+                continue;
+            }
+            return -1;
+        }
+        if (bytes == 0) {
+            break;
+        }
+        filled += (size_t)bytes;
+    }
+    *data = reader->buffer;
+    return (ssize_t)filled;
+}
+
+/* Drops the chunk handed out last from the page cache once the caller is done with it. */
+static void input_drop_behind(InputReader *reader) {
+    if (reader->dropBehind && reader->lastLength > 0) {
+        uint64_t from = reader->consumed > DROP_BEHIND_LAG ? reader->consumed - DROP_BEHIND_LAG : 0;
+        posix_fadvise(reader->fd, (off_t)from, (off_t)(reader->consumed + reader->lastLength - from), POSIX_FADV_DONTNEED);
+    }
+    reader->consumed += reader->lastLength;
+    reader->lastLength = 0;
+}
+
+/* Returns the chunk length, 0 at end of input or -1 on a read error. */
+static ssize_t input_next(InputReader *reader, const uint8_t **data) {
+    input_drop_behind(reader);
+    ssize_t length = input_next_chunk(reader, data);
+    reader->lastLength = length > 0 ? (size_t)length : 0;
+    return length;
+}
+
+static void input_close(InputReader *reader) {
+    if (reader->fd >= 0 && reader->dropBehind) {
+        input_drop_behind(reader);
+        posix_fadvise(reader->fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    if (reader->pipe != NULL) {
+        pipe_reader_close(reader->pipe);
+    }
+    if (reader->uring != NULL) {
+        uring_reader_free(reader->uring);
+    }
+    if (reader->map != NULL) {
+        munmap(reader->map, reader->mapLength);
+    }
+    io_buffer_put(reader->buffer, INPUT_BUFFER_SIZE);
+    if (reader->fd >= 0) {
+        close(reader->fd);
+    }
+    memset(reader, 0, sizeof(*reader));
+    reader->fd = -1;
+}
+
+typedef void (*xor_fold_fn)(uint8_t *lane, const uint8_t *data, size_t length);
+
+/* Folds length bytes (a multiple of XOR_LANE_BYTES) into a 64-byte lane. */
+static void xor_fold_scalar(uint8_t *lane, const uint8_t *data, size_t length) {
+    uint64_t acc[XOR_LANE_BYTES / 8];
+    memcpy(acc, lane, XOR_LANE_BYTES);
+    for (size_t offset = 0; offset < length; offset += XOR_LANE_BYTES) {
+        for (int i = 0; i < XOR_LANE_BYTES / 8; i++) {
+            uint64_t word;
+            memcpy(&word, data + offset + i * 8, 8);
+            acc[i] ^= word;
+        }
+    }
+    memcpy(lane, acc, XOR_LANE_BYTES);
+}
+
+#ifdef HAVE_X86
+__attribute__((target("sse2")))
+static void xor_fold_sse2(uint8_t *lane, const uint8_t *data, size_t length) {
+    __m128i a0 = _mm_loadu_si128((const __m128i *)lane);
+    __m128i a1 = _mm_loadu_si128((const __m128i *)(lane + 16));
+    __m128i a2 = _mm_loadu_si128((const __m128i *)(lane + 32));
+    __m128i a3 = _mm_loadu_si128((const __m128i *)(lane + 48));
+    for (size_t offset = 0; offset < length; offset += XOR_LANE_BYTES) {
+        const uint8_t *p = data + offset;
+        a0 = _mm_xor_si128(a0, _mm_loadu_si128((const __m128i *)p));
+        a1 = _mm_xor_si128(a1, _mm_loadu_si128((const __m128i *)(p + 16)));
+        a2 = _mm_xor_si128(a2, _mm_loadu_si128((const __m128i *)(p + 32)));
+        a3 = _mm_xor_si128(a3, _mm_loadu_si128((const __m128i *)(p + 48)));
+    }
+    _mm_storeu_si128((__m128i *)lane, a0);
+    _mm_storeu_si128((__m128i *)(lane + 16), a1);
+    _mm_storeu_si128((__m128i *)(lane + 32), a2);
+    _mm_storeu_si128((__m128i *)(lane + 48), a3);
+}
+
+__attribute__((target("avx2")))
+static void xor_fold_avx2(uint8_t *lane, const uint8_t *data, size_t length) {
+    __m256i a0 = _mm256_loadu_si256((const __m256i *)lane);
+    __m256i a1 = _mm256_loadu_si256((const __m256i *)(lane + 32));
+    __m256i b0 = _mm256_setzero_si256();
+    __m256i b1 = _mm256_setzero_si256();
+    size_t offset = 0;
+    for (; offset + 2 * XOR_LANE_BYTES <= length; offset += 2 * XOR_LANE_BYTES) {
+        const uint8_t *p = data + offset;
+        a0 = _mm256_xor_si256(a0, _mm256_loadu_si256((const __m256i *)p));
+        a1 = _mm256_xor_si256(a1, _mm256_loadu_si256((const __m256i *)(p + 32)));
+        b0 = _mm256_xor_si256(b0, _mm256_loadu_si256((const __m256i *)(p + 64)));
+        b1 = _mm256_xor_si256(b1, _mm256_loadu_si256((const __m256i *)(p + 96)));
+    }
+    if (offset < length) {
+        a0 = _mm256_xor_si256(a0, _mm256_loadu_si256((const __m256i *)(data + offset)));
+        a1 = _mm256_xor_si256(a1, _mm256_loadu_si256((const __m256i *)(data + offset + 32)));
+    }
+    _mm256_storeu_si256((__m256i *)lane, _mm256_xor_si256(a0, b0));
+    _mm256_storeu_si256((__m256i *)(lane + 32), _mm256_xor_si256(a1, b1));
+}
+
+__attribute__((target("avx512f")))
+static void xor_fold_avx512(uint8_t *lane, const uint8_t *data, size_t length) {
+    __m512i a0 = _mm512_loadu_si512((const void *)lane);
+    __m512i a1 = _mm512_setzero_si512();
+    __m512i a2 = _mm512_setzero_si512();
+    __m512i a3 = _mm512_setzero_si512();
+    size_t offset = 0;
+    for (; offset + 4 * XOR_LANE_BYTES <= length; offset += 4 * XOR_LANE_BYTES) {
+        const uint8_t *p = data + offset;
+        a0 = _mm512_xor_si512(a0, _mm512_loadu_si512((const void *)p));
+        a1 = _mm512_xor_si512(a1, _mm512_loadu_si512((const void *)(p + 64)));
+        a2 = _mm512_xor_si512(a2, _mm512_loadu_si512((const void *)(p + 128)));
+        a3 = _mm512_xor_si512(a3, _mm512_loadu_si512((const void *)(p + 192)));
+    }
+    for (; offset < length; offset += XOR_LANE_BYTES) {
+        a0 = _mm512_xor_si512(a0, _mm512_loadu_si512((const void *)(data + offset)));
+    }
+    a0 = _mm512_xor_si512(_mm512_xor_si512(a0, a1), _mm512_xor_si512(a2, a3));
+    _mm512_storeu_si512((void *)lane, a0);
+}
+#endif
+
+static xor_fold_fn select_xor_fold(void) {
+#ifdef HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return xor_fold_avx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return xor_fold_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return xor_fold_sse2;
+    }
+#endif
+    return xor_fold_scalar;
+}
+
+/* Folds an arbitrary chunk; every chunk but the last must be a multiple of XOR_LANE_BYTES. */
+static void xor_fold_chunk(xor_fold_fn fold, uint8_t *lane, const uint8_t *data, size_t length) {
+    size_t bulk = length - length % XOR_LANE_BYTES;
+    if (bulk > 0) {
+        fold(lane, data, bulk);
+    }
+    for (size_t i = bulk; i < length; i++) {
+        lane[i - bulk] ^= data[i];
+    }
+}
+
+/* dst ^= src over length bytes, for accumulators wider than one lane. */
+typedef void (*xor_into_fn)(uint8_t *dst, const uint8_t *src, size_t length);
+
+static inline __attribute__((always_inline)) void xor_into_body(uint8_t *dst, const uint8_t *src, size_t length) {
+    typedef uint8_t bytes_t __attribute__((vector_size(XOR_LANE_BYTES)));
+    size_t i = 0;
+    for (; i + XOR_LANE_BYTES <= length; i += XOR_LANE_BYTES) {
+        bytes_t a, b;
+        memcpy(&a, dst + i, sizeof(a));
+        memcpy(&b, src + i, sizeof(b));
+        a ^= b;
+        memcpy(dst + i, &a, sizeof(a));
+    }
+    for (; i < length; i++) {
+        dst[i] ^= src[i];
+    }
+}
+
+static void xor_into_generic(uint8_t *dst, const uint8_t *src, size_t length) {
+    xor_into_body(dst, src, length);
+}
+
+#ifdef HAVE_X86
+__attribute__((target("avx2")))
+static void xor_into_avx2(uint8_t *dst, const uint8_t *src, size_t length) {
+    xor_into_body(dst, src, length);
+}
+
+__attribute__((target("avx512f")))
+static void xor_into_avx512(uint8_t *dst, const uint8_t *src, size_t length) {
+    xor_into_body(dst, src, length);
+}
+#endif
+
+static xor_into_fn select_xor_into(void) {
+#ifdef HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return xor_into_avx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return xor_into_avx2;
+    }
+#endif
+    return xor_into_generic;
+}
+
+/*
+ * CRC32C (Castagnoli, reflected 0x82F63B78) with the usual ~0 pre- and
+ * post-conditioning, so crc32c_update(0, ...) is the standard checksum and
+ * updates chain across chunks. The portable path is slicing-by-8.
+ */
+#define CRC32C_POLY 0x82F63B78u
+
+typedef uint32_t (*crc32c_fn)(uint32_t crc, const uint8_t *data, size_t length);
+typedef uint32_t (*crc32c_shift_fn)(uint32_t crc, uint64_t bytes);
+
+static uint32_t crc32cTable[8][256];
+/* crc32cPowers[k] is x^(2^k) mod P, used to append 2^k zero bits */
+static uint32_t crc32cPowers[64];
+/* x^(2^k - 32) mod P for k >= 5, consumed by the CLMUL shift */
+static uint32_t crc32cClmulPowers[64];
+static crc32c_fn crc32cUpdate;
+static crc32c_shift_fn crc32cShift;
+
+static uint32_t crc32c_scalar(uint32_t crc, const uint8_t *data, size_t length) {
+    crc = ~crc;
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        word = le64toh(word) ^ crc;
+        crc = crc32cTable[7][word & 0xFF] ^ crc32cTable[6][(word >> 8) & 0xFF] ^
+              crc32cTable[5][(word >> 16) & 0xFF] ^ crc32cTable[4][(word >> 24) & 0xFF] ^
+              crc32cTable[3][(word >> 32) & 0xFF] ^ crc32cTable[2][(word >> 40) & 0xFF] ^
+              crc32cTable[1][(word >> 48) & 0xFF] ^ crc32cTable[0][word >> 56];
+        data += 8;
+        length -= 8;
+    }
+    while (length-- > 0) {
+        crc = crc32cTable[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/* a * b mod P in the reflected representation (bit 31 is x^0) */
+static uint32_t crc32c_multmod(uint32_t a, uint32_t b) {
+    uint32_t m = (uint32_t)1 << 31;
+    uint32_t product = 0;
+    while (m != 0) {
+        if (a & m) {
+            product ^= b;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return product;
+}
+
+/* x^exponent mod P */
+static uint32_t crc32c_xpow(uint64_t exponent) {
+    uint32_t power = (uint32_t)1 << 31;
+    for (int k = 0; exponent != 0; k++, exponent >>= 1) {
+        if (exponent & 1) {
+            power = crc32c_multmod(crc32cPowers[k], power);
+        }
+    }
+    return power;
+}
+
+/* the CRC register after `bytes` more zero bytes, without conditioning */
+static uint32_t crc32c_shift_scalar(uint32_t crc, uint64_t bytes) {
+    for (int k = 3; bytes != 0; k++, bytes >>= 1) {
+        if (bytes & 1) {
+            crc = crc32c_multmod(crc32cPowers[k], crc);
+        }
+    }
+    return crc;
+}
+
+#ifdef HAVE_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data, size_t length) {
+    uint64_t c = ~crc;
+    while (length > 0 && ((uintptr_t)data & 7) != 0) {
+        c = _mm_crc32_u8((uint32_t)c, *data++);
+        length--;
+    }
+    for (; length >= 8; data += 8, length -= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        c = _mm_crc32_u64(c, word);
+    }
+    while (length-- > 0) {
+        c = _mm_crc32_u8((uint32_t)c, *data++);
+    }
+    return ~(uint32_t)c;
+}
+
+/*
+ * clmul(a, b) << 1 is the 64-bit reflected product, and crc32 of that word
+ * reduces it while multiplying by x^32, which the table compensates for.
+ * The last 0..3 bytes of the shift are single zero-byte crc32 steps.
+ */
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_shift_clmul(uint32_t crc, uint64_t bytes) {
+    for (uint64_t i = 0; i < (bytes & 3); i++) {
+        crc = _mm_crc32_u8(crc, 0);
+    }
+    bytes >>= 2;
+    for (int k = 5; bytes != 0; k++, bytes >>= 1) {
+        if (bytes & 1) {
+            __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128((int)crc),
+                                                   _mm_cvtsi32_si128((int)crc32cClmulPowers[k]), 0);
+            crc = (uint32_t)_mm_crc32_u64(0, (uint64_t)_mm_cvtsi128_si64(product) << 1);
+        }
+    }
+    return crc;
+}
+#endif
+
+/* Builds the tables and picks the kernels; call before any thread uses them. */
+static void crc32c_init(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32cTable[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        for (int t = 1; t < 8; t++) {
+            crc32cTable[t][n] = crc32cTable[0][crc32cTable[t - 1][n] & 0xFF] ^ (crc32cTable[t - 1][n] >> 8);
+        }
+    }
+    crc32cPowers[0] = (uint32_t)1 << 30;
+    for (int k = 1; k < 64; k++) {
+        crc32cPowers[k] = crc32c_multmod(crc32cPowers[k - 1], crc32cPowers[k - 1]);
+    }
+    for (int k = 5; k < 64; k++) {
+        crc32cClmulPowers[k] = crc32c_xpow(((uint64_t)1 << k) - 32);
+    }
+    crc32cUpdate = crc32c_scalar;
+    crc32cShift = crc32c_shift_scalar;
+#ifdef HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32cUpdate = crc32c_sse42;
+        if (__builtin_cpu_supports("pclmul")) {
+            crc32cShift = crc32c_shift_clmul;
+        }
+    }
+#endif
+}
+
+/* CRC32C of A followed by B, given both checksums and the length of B. */
+static uint32_t crc32c_combine(uint32_t crcA, uint32_t crcB, uint64_t lengthB) {
+    return crc32cShift(crcA, lengthB) ^ crcB;
+}
+
+/* Streaming XXH64 (seed 0), fed in arbitrary pieces. */
+#define XXH_PRIME1 11400714785074694791ULL
+#define XXH_PRIME2 14029467366897019727ULL
+#define XXH_PRIME3 1609587929392839161ULL
+#define XXH_PRIME4 9650029242287828579ULL
+#define XXH_PRIME5 2870177450012600261ULL
+
+typedef struct {
+    uint64_t v[4];
+    uint8_t buffer[32];
+    size_t buffered;
+    uint64_t total;
+} Xxh64State;
+
+static uint64_t xxh64_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    return xxh64_rotl(acc + input * XXH_PRIME2, 31) * XXH_PRIME1;
+}
+
+static uint64_t xxh64_read64(const uint8_t *p) {
+    uint64_t value;
+    memcpy(&value, p, 8);
+    return le64toh(value);
+}
+
+static void xxh64_init(Xxh64State *state) {
+    memset(state, 0, sizeof(*state));
+    state->v[0] = XXH_PRIME1 + XXH_PRIME2;
+    state->v[1] = XXH_PRIME2;
+    state->v[2] = 0;
+    state->v[3] = -XXH_PRIME1;
+}
+
+static void xxh64_stripes(Xxh64State *state, const uint8_t *data, size_t stripes) {
+    uint64_t v0 = state->v[0], v1 = state->v[1], v2 = state->v[2], v3 = state->v[3];
+    for (size_t i = 0; i < stripes; i++, data += 32) {
+        v0 = xxh64_round(v0, xxh64_read64(data));
+        v1 = xxh64_round(v1, xxh64_read64(data + 8));
+        v2 = xxh64_round(v2, xxh64_read64(data + 16));
+        v3 = xxh64_round(v3, xxh64_read64(data + 24));
+    }
+    state->v[0] = v0;
+    state->v[1] = v1;
+    state->v[2] = v2;
+    state->v[3] = v3;
+}
+
+static void xxh64_update(Xxh64State *state, const uint8_t *data, size_t length) {
+    state->total += length;
+    if (state->buffered > 0) {
+        size_t take = 32 - state->buffered < length ? 32 - state->buffered : length;
+        memcpy(state->buffer + state->buffered, data, take);
+        state->buffered += take;
+        data += take;
+        length -= take;
+        if (state->buffered < 32) {
+            return;
+        }
+        xxh64_stripes(state, state->buffer, 1);
+        state->buffered = 0;
+    }
+    xxh64_stripes(state, data, length / 32);
+    memcpy(state->buffer, data + length - length % 32, length % 32);
+    state->buffered = length % 32;
+}
+
+static uint64_t xxh64_digest(const Xxh64State *state) {
+    uint64_t h;
+    if (state->total >= 32) {
+        h = xxh64_rotl(state->v[0], 1) + xxh64_rotl(state->v[1], 7) +
+            xxh64_rotl(state->v[2], 12) + xxh64_rotl(state->v[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h = (h ^ xxh64_round(0, state->v[i])) * XXH_PRIME1 + XXH_PRIME4;
+        }
+    } else {
+        h = XXH_PRIME5;
+    }
+    h += state->total;
+    const uint8_t *p = state->buffer;
+    size_t left = state->buffered;
+    for (; left >= 8; p += 8, left -= 8) {
+        h = xxh64_rotl(h ^ xxh64_round(0, xxh64_read64(p)), 27) * XXH_PRIME1 + XXH_PRIME4;
+    }
+    if (left >= 4) {
+        uint32_t word;
+        memcpy(&word, p, 4);
+        h = xxh64_rotl(h ^ (uint64_t)le32toh(word) * XXH_PRIME1, 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+        left -= 4;
+    }
+    for (; left > 0; p++, left--) {
+        h = xxh64_rotl(h ^ *p * XXH_PRIME5, 11) * XXH_PRIME1;
+    }
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* Checksums computed next to the xor fold, over the same chunks. */
+typedef struct {
+    int kinds;
+    uint32_t crc;
+    Xxh64State xxh;
+} Checksums;
+
+static void checksums_init(Checksums *sums, int kinds) {
+    sums->kinds = kinds;
+    sums->crc = 0;
+    xxh64_init(&sums->xxh);
+}
+
+static void checksums_update(Checksums *sums, const uint8_t *data, size_t length) {
+    if (sums->kinds & CHECKSUM_CRC32C) {
+        sums->crc = crc32cUpdate(sums->crc, data, length);
+    }
+    if (sums->kinds & CHECKSUM_XXH64) {
+        xxh64_update(&sums->xxh, data, length);
+    }
+}
+
+/*
+ * What a file is folded into: the 64-byte lane for blocks up to 2^9 bits,
+ * otherwise a buffer as wide as the widest requested block.
+ */
+typedef struct {
+    xor_fold_fn fold;
+    xor_into_fn into;
+    size_t width;
+} XorFolder;
+
+/*
+ * Folds data starting at stream position `position` into a wide accumulator.
+ * Whole periods of the input are folded tile by tile, so each XOR_TILE_BYTES
+ * piece of the accumulator stays in L1 while the matching piece of every
+ * period is XOR-ed into it, instead of streaming the whole accumulator
+ * through the cache once per period.
+ */
+static void xor_fold_wide(const XorFolder *folder, uint8_t *acc, uint64_t position,
+                          const uint8_t *data, size_t length) {
+    size_t width = folder->width;
+    size_t start = (size_t)(position % width);
+    if (start != 0) {
+        size_t head = width - start < length ? width - start : length;
+        folder->into(acc + start, data, head);
+        data += head;
+        length -= head;
+    }
+    size_t periods = length / width;
+    if (periods > 0) {
+        for (size_t tile = 0; tile < width; tile += XOR_TILE_BYTES) {
+            size_t tileLength = width - tile < XOR_TILE_BYTES ? width - tile : XOR_TILE_BYTES;
+            for (size_t p = 0; p < periods; p++) {
+                folder->into(acc + tile, data + p * width + tile, tileLength);
+            }
+        }
+        data += periods * width;
+        length -= periods * width;
+    }
+    folder->into(acc, data, length);
+}
+
+static void xor_fold_at(const XorFolder *folder, uint8_t *acc, uint64_t position,
+                        const uint8_t *data, size_t length) {
+    if (folder->width == XOR_LANE_BYTES) {
+        xor_fold_chunk(folder->fold, acc, data, length);
+    } else {
+        xor_fold_wide(folder, acc, position, data, length);
+    }
+}
+
+/* Reduces the accumulator to one block; a missing tail acts as zero padding. */
+static void xor_reduce(const uint8_t *acc, size_t width, uint8_t *result, size_t blockSizeBytes) {
+    memcpy(result, acc, blockSizeBytes);
+    for (size_t offset = blockSizeBytes; offset < width; offset += blockSizeBytes) {
+        for (size_t i = 0; i < blockSizeBytes; i++) {
+            result[i] ^= acc[offset + i];
+        }
+    }
+}
+
+/* One XOR_LANE_BYTES-aligned byte range of a file, folded independently on the pool. */
+typedef struct {
+    int fd;
+    const XorFolder *folder;
+    uint64_t offset;
+    size_t length;
+    size_t bytesRead;
+    int failed;
+    /* each range folds into its own accumulator and merges it here when done; NULL skips xor */
+    uint8_t *acc;
+    pthread_mutex_t *accLock;
+    /* CRC32C of this range alone, combined in file order afterwards */
+    int crc;
+    uint32_t rangeCrc;
+    /* --io=direct: the shared descriptor has O_DIRECT, or read chunks are dropped from the cache */
+    int direct;
+    int dropBehind;
+    uint8_t firstByte;
+} XorRange;
+
+static void xor_range_merge(XorRange *range, const uint8_t *acc) {
+    if (acc == NULL) {
+        return;
+    }
+    pthread_mutex_lock(range->accLock);
+    range->folder->into(range->acc, acc, range->folder->width);
+    pthread_mutex_unlock(range->accLock);
+}
+
+static void xor_range_fold(XorRange *range, uint8_t *acc, uint64_t position, const uint8_t *data, size_t length) {
+    if (position == 0 && length > 0) {
+        range->firstByte = data[0];
+    }
+    if (acc != NULL) {
+        xor_fold_at(range->folder, acc, position, data, length);
+    }
+    if (range->crc) {
+        range->rangeCrc = crc32cUpdate(range->rangeCrc, data, length);
+    }
+}
+
+static void xor_range_task(void *arg) {
+    XorRange *range = (XorRange *)arg;
+    size_t width = range->folder->width;
+    uint8_t *acc = NULL;
+    if (range->acc != NULL) {
+        acc = (uint8_t *)aligned_alloc(XOR_LANE_BYTES, width);
+        if (acc == NULL) {
+            range->failed = 1;
+            return;
+        }
+        memset(acc, 0, width);
+    }
+    if (options.ioBackend == IO_MMAP) {
+        void *map = mmap(NULL, range->length, PROT_READ, MAP_PRIVATE, range->fd, (off_t)range->offset);
+        if (map != MAP_FAILED) {
+            madvise(map, range->length, MADV_SEQUENTIAL);
+            xor_range_fold(range, acc, range->offset, (const uint8_t *)map, range->length);
+            munmap(map, range->length);
+            range->bytesRead = range->length;
+            xor_range_merge(range, acc);
+            free(acc);
+            return;
+        }
+    }
+    uint8_t *buffer = io_buffer_take(INPUT_BUFFER_SIZE);
+    if (buffer == NULL) {
+        range->failed = 1;
+        free(acc);
+        return;
+    }
+    while (range->bytesRead < range->length) {
+        size_t want = range->length - range->bytesRead;
+        if (want > INPUT_BUFFER_SIZE) {
+            want = INPUT_BUFFER_SIZE;
+        }
+        /* only the file's tail can be unaligned; O_DIRECT reads it as whole blocks and gets the rest back */
+        size_t request = range->direct ? (want + DIRECT_IO_ALIGN - 1) & ~(size_t)(DIRECT_IO_ALIGN - 1) : want;
+        ssize_t bytes = pread(range->fd, buffer, request, (off_t)(range->offset + range->bytesRead));
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes < 0 && errno == EINVAL && range->direct) {
+            direct_io_disable(range->fd);
+            range->direct = 0;
+            continue;
+        }
+        if (bytes < 0) {
+            range->failed = 1;
+            break;
+        }
+        if (bytes == 0) {
+            break;
+        }
+        /* pread may come back short, so refill until the piece is lane-aligned */
+        size_t filled = (size_t)bytes < want ? (size_t)bytes : want;
+        while (filled < want && filled % XOR_LANE_BYTES != 0) {
+            bytes = pread(range->fd, buffer + filled, want - filled, (off_t)(range->offset + range->bytesRead + filled));
+            if (bytes < 0 && errno == EINVAL && range->direct) {
+                direct_io_disable(range->fd);
+                range->direct = 0;
+                continue;
+            }
+            if (bytes <= 0) {
+                break;
+            }
+            filled += (size_t)bytes;
+        }
+        xor_range_fold(range, acc, range->offset + range->bytesRead, buffer, filled);
+        if (range->dropBehind) {
+            uint64_t from = range->bytesRead > DROP_BEHIND_LAG ? range->offset + range->bytesRead - DROP_BEHIND_LAG : range->offset;
+            posix_fadvise(range->fd, (off_t)from, (off_t)(range->offset + range->bytesRead + filled - from),
+                          POSIX_FADV_DONTNEED);
+        }
+        range->bytesRead += filled;
+        if (filled % XOR_LANE_BYTES != 0) {
+            break;
+        }
+    }
+    io_buffer_put(buffer, INPUT_BUFFER_SIZE);
+    xor_range_merge(range, acc);
+    free(acc);
+}
+
+/*
+ * Splits a large regular file into XOR_SPLIT_CHUNK ranges folded in
+ * parallel. XOR is associative and every range starts on a lane boundary
+ * (and knows its position within a wide accumulator), so XOR-ing the
+ * partial accumulators gives exactly the sequential one. Range CRCs are
+ * joined with crc32c_combine, which is what keeps CRC32C correct here.
+ */
+static int xor_file_parallel(int fd, uint64_t size, const XorFolder *folder, WorkerPool *pool,
+                             uint8_t *acc, Checksums *sums, uint64_t *totalBytes, uint8_t *firstByte) {
+    int direct = options.ioBackend == IO_DIRECT && direct_io_enable(fd);
+    size_t rangeCount = (size_t)((size + XOR_SPLIT_CHUNK - 1) / XOR_SPLIT_CHUNK);
+    XorRange *ranges = (XorRange *)calloc(rangeCount, sizeof(XorRange));
+    if (ranges == NULL) {
+        return -2;
+    }
+    pthread_mutex_t accLock = PTHREAD_MUTEX_INITIALIZER;
+    for (size_t i = 0; i < rangeCount; i++) {
+        ranges[i].fd = fd;
+        ranges[i].folder = folder;
+        ranges[i].offset = (uint64_t)i * XOR_SPLIT_CHUNK;
+        ranges[i].length = i + 1 < rangeCount ? XOR_SPLIT_CHUNK : (size_t)(size - ranges[i].offset);
+        ranges[i].acc = acc;
+        ranges[i].accLock = &accLock;
+        ranges[i].crc = (sums->kinds & CHECKSUM_CRC32C) != 0;
+        ranges[i].direct = direct;
+        ranges[i].dropBehind = options.ioBackend == IO_DIRECT && !direct;
+        if (pool_submit(pool, xor_range_task, &ranges[i]) != 0) {
+            xor_range_task(&ranges[i]);
+        }
+    }
+    pool_wait(pool);
+
+    int status = 0;
+    for (size_t i = 0; i < rangeCount; i++) {
+        /* a short range before the last one means the file shrank under us */
+        if (ranges[i].failed || (i + 1 < rangeCount && ranges[i].bytesRead != ranges[i].length)) {
+            status = -2;
+        }
+        if (ranges[i].crc) {
+            sums->crc = crc32c_combine(sums->crc, ranges[i].rangeCrc, ranges[i].bytesRead);
+        }
+        *totalBytes += ranges[i].bytesRead;
+    }
+    if (ranges[0].bytesRead == 0) {
+        status = -2;
+    }
+    *firstByte = ranges[0].firstByte;
+    /* whatever straddled two ranges goes now that both are done */
+    if (ranges[0].dropBehind) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    pthread_mutex_destroy(&accLock);
+    free(ranges);
+    return status;
+}
+
+/*
+ * Folds a whole file into acc (unless NULL) and sums; returns -1 if it cannot
+ * be opened and -2 on a read error.
+ */
+static int xor_file(const char *path, const XorFolder *folder, WorkerPool *pool,
+                    uint8_t *acc, Checksums *sums, uint64_t *totalBytes, uint8_t *firstByte) {
+    *totalBytes = 0;
+    /*
+     * Every running range holds its own accumulator, so very wide ones stay
+     * sequential, and XXH64 has no way to join independently hashed ranges.
+     */
+    if (pool != NULL && folder->width <= XOR_SPLIT_MAX_WIDTH && !(sums->kinds & CHECKSUM_XXH64) &&
+        strcmp(path, "-") != 0) {
+        int fd = open(path, O_RDONLY);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+            (uint64_t)st.st_size >= 2 * (uint64_t)XOR_SPLIT_CHUNK) {
+            int status = xor_file_parallel(fd, (uint64_t)st.st_size, folder, pool, acc, sums, totalBytes, firstByte);
+            close(fd);
+            return status;
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    InputReader reader;
+    if (input_open(&reader, path, options.ioBackend) != 0) {
+        return -1;
+    }
+    int status = 0;
+    while (1) {
+        const uint8_t *chunk;
+        ssize_t bytesRead = input_next(&reader, &chunk);
+        if (bytesRead < 0) {
+            status = -2;
+            break;
+        }
+        if (bytesRead == 0) {
+            break;
+        }
+        if (*totalBytes == 0) {
+            *firstByte = chunk[0];
+        }
+        if (acc != NULL) {
+            xor_fold_at(folder, acc, *totalBytes, chunk, (size_t)bytesRead);
+        }
+        checksums_update(sums, chunk, (size_t)bytesRead);
+        *totalBytes += (uint64_t)bytesRead;
+    }
+    input_close(&reader);
+    return status;
+}
+
+/*
+ * On-disk xorN result cache. The file is a header followed by entries sorted
+ * by (dev, ino, n), native byte order, so it is mapped and binary searched
+ * as is. An entry only counts while size and mtime still match. Updates are
+ * merged into a new file that replaces the old one with rename(), so readers
+ * never see a half-written index.
+ */
+#define XOR_CACHE_MAGIC "2XORCACH"
+#define XOR_CACHE_VERSION 1
+/* files touched this recently may still change within one mtime tick */
+#define XOR_CACHE_RACY_NS 2000000000LL
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t entrySize;
+    uint64_t count;
+} XorCacheHeader;
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtimeNs;
+    uint8_t n;
+    uint8_t length;
+    uint8_t reserved[6];
+    uint8_t value[8];
+} XorCacheEntry;
+
+typedef struct {
+    const char *path;
+    void *map;
+    size_t mapLength;
+    const XorCacheEntry *entries;
+    size_t count;
+    uint8_t *used;
+    XorCacheEntry *added;
+    size_t addedCount;
+    size_t addedCapacity;
+    int64_t startNs;
+} XorCache;
+
+static int xor_cache_compare(const XorCacheEntry *a, const XorCacheEntry *b) {
+    if (a->dev != b->dev) {
+        return a->dev < b->dev ? -1 : 1;
+    }
+    if (a->ino != b->ino) {
+        return a->ino < b->ino ? -1 : 1;
+    }
+    return (int)a->n - (int)b->n;
+}
+
+static int xor_cache_sort_compare(const void *a, const void *b) {
+    return xor_cache_compare((const XorCacheEntry *)a, (const XorCacheEntry *)b);
+}
+
+static void xor_cache_key(XorCacheEntry *entry, const struct stat *st, int N) {
+    memset(entry, 0, sizeof(*entry));
+    entry->dev = (uint64_t)st->st_dev;
+    entry->ino = (uint64_t)st->st_ino;
+    entry->size = (uint64_t)st->st_size;
+    entry->mtimeNs = (int64_t)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+    entry->n = (uint8_t)N;
+}
+
+/* A missing or unreadable cache file just starts empty. */
+static void xor_cache_open(XorCache *cache, const char *path) {
+    memset(cache, 0, sizeof(*cache));
+    cache->path = path;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    cache->startNs = (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    void *map = (size_t)st.st_size < sizeof(XorCacheHeader) ? MAP_FAILED
+              : mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        printf("Ignoring invalid cache file %s\n", path);
+        return;
+    }
+    const XorCacheHeader *header = (const XorCacheHeader *)map;
+    size_t entryBytes = (size_t)st.st_size - sizeof(XorCacheHeader);
+    if (memcmp(header->magic, XOR_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != XOR_CACHE_VERSION || header->entrySize != sizeof(XorCacheEntry) ||
+        header->count != entryBytes / sizeof(XorCacheEntry) || entryBytes % sizeof(XorCacheEntry) != 0) {
+        printf("Ignoring invalid cache file %s\n", path);
+        munmap(map, (size_t)st.st_size);
+        return;
+    }
+    cache->map = map;
+    cache->mapLength = (size_t)st.st_size;
+    cache->entries = (const XorCacheEntry *)(header + 1);
+    cache->count = (size_t)header->count;
+    cache->used = (uint8_t *)calloc(cache->count ? cache->count : 1, 1);
+}
+
+/* Returns the cached entry for st and N, or NULL when absent or stale. */
+static const XorCacheEntry *xor_cache_lookup(XorCache *cache, const struct stat *st, int N) {
+    XorCacheEntry key;
+    xor_cache_key(&key, st, N);
+    size_t low = 0;
+    size_t high = cache->count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        int order = xor_cache_compare(&cache->entries[mid], &key);
+        if (order == 0) {
+            const XorCacheEntry *entry = &cache->entries[mid];
+            if (entry->size != key.size || entry->mtimeNs != key.mtimeNs) {
+                return NULL;
+            }
+            if (cache->used != NULL) {
+                cache->used[mid] = 1;
+            }
+            return entry;
+        }
+        if (order < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return NULL;
+}
+
+static void xor_cache_store(XorCache *cache, const struct stat *st, int N, const uint8_t *value, size_t length) {
+    XorCacheEntry entry;
+    xor_cache_key(&entry, st, N);
+    if (length > sizeof(entry.value) || entry.mtimeNs > cache->startNs - XOR_CACHE_RACY_NS) {
+        return;
+    }
+    if (cache->addedCount == cache->addedCapacity) {
+        size_t capacity = cache->addedCapacity ? cache->addedCapacity * 2 : 64;
+        XorCacheEntry *added = (XorCacheEntry *)realloc(cache->added, capacity * sizeof(XorCacheEntry));
+        if (added == NULL) {
+            return;
+        }
+        cache->added = added;
+        cache->addedCapacity = capacity;
+    }
+    entry.length = (uint8_t)length;
+    memcpy(entry.value, value, length);
+    cache->added[cache->addedCount++] = entry;
+}
+
+/*
+ * Merges new entries over the mapped ones (a new entry replaces any old one
+ * with the same key) and atomically replaces the file. With compact set only
+ * entries looked up or computed in this run survive.
+ */
+static int xor_cache_save(XorCache *cache, int compact) {
+    if (cache->addedCount == 0 && !compact) {
+        return 0;
+    }
+    qsort(cache->added, cache->addedCount, sizeof(XorCacheEntry), xor_cache_sort_compare);
+
+    char tempPath[PATH_MAX];
+    snprintf(tempPath, sizeof(tempPath), "%s.XXXXXX", cache->path);
+    int fd = mkstemp(tempPath);
+    if (fd >= 0) {
+        fchmod(fd, 0644);
+    }
+    if (fd < 0) {
+        printf("Cannot write cache file %s\n", cache->path);
+        return -1;
+    }
+    FILE *out = fdopen(fd, "wb");
+    if (out == NULL) {
+        close(fd);
+        unlink(tempPath);
+        return -1;
+    }
+    XorCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, XOR_CACHE_MAGIC, sizeof(header.magic));
+    header.version = XOR_CACHE_VERSION;
+    header.entrySize = sizeof(XorCacheEntry);
+    fwrite(&header, sizeof(header), 1, out);
+
+    size_t oldIndex = 0;
+    size_t newIndex = 0;
+    uint64_t written = 0;
+    while (oldIndex < cache->count || newIndex < cache->addedCount) {
+        const XorCacheEntry *entry;
+        int order = oldIndex == cache->count ? 1 : newIndex == cache->addedCount ? -1
+                  : xor_cache_compare(&cache->entries[oldIndex], &cache->added[newIndex]);
+        if (order < 0) {
+            entry = !compact || cache->used == NULL || cache->used[oldIndex] ? &cache->entries[oldIndex] : NULL;
+            oldIndex++;
+        } else {
+            /* the same file can show up twice in one run; keep the last result */
+            entry = &cache->added[newIndex++];
+            while (newIndex < cache->addedCount && xor_cache_compare(entry, &cache->added[newIndex]) == 0) {
+                entry = &cache->added[newIndex++];
+            }
+            if (order == 0) {
+                oldIndex++;
+            }
+        }
+        if (entry != NULL) {
+            fwrite(entry, sizeof(*entry), 1, out);
+            written++;
+        }
+    }
+
+    header.count = written;
+    int failed = fseek(out, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, out) != 1;
+    failed |= fflush(out) != 0 || fsync(fd) != 0;
+    failed |= fclose(out) != 0;
+    if (failed || rename(tempPath, cache->path) != 0) {
+        printf("Cannot write cache file %s\n", cache->path);
+        unlink(tempPath);
+        return -1;
+    }
+    return 0;
+}
+
+static void xor_cache_close(XorCache *cache) {
+    if (cache->map != NULL) {
+        munmap(cache->map, cache->mapLength);
+    }
+    free(cache->used);
+    free(cache->added);
+}
+
+/*
+ * ns lists the block widths to report, each 2..MAX_XOR_N. The file is read
+ * once into an accumulator as wide as the largest block; every narrower
+ * block divides it, so each N is just a further fold of the same data.
+ * options.checksums are computed from the same reads; with nCount == 0 they
+ * are the only output.
+ */
+int xorN(int fileCount, char *files[], const int *ns, int nCount) {
+    size_t widest = 0;
+    for (int k = 0; k < nCount; k++) {
+        if ((size_t)BLOCK_SIZE_BYTES(ns[k]) > widest) {
+            widest = (size_t)BLOCK_SIZE_BYTES(ns[k]);
+        }
+    }
+    XorFolder folder = { select_xor_fold(), select_xor_into(), widest > XOR_LANE_BYTES ? widest : XOR_LANE_BYTES };
+    uint8_t *acc = nCount > 0 ? (uint8_t *)aligned_alloc(XOR_LANE_BYTES, folder.width) : NULL;
+    uint8_t *resultMemory = (uint8_t *)malloc(widest > 0 ? widest : 1);
+    if ((nCount > 0 && acc == NULL) || resultMemory == NULL) {
+        printf("Cannot allocate memory for block or result\n");
+        free(acc);
+        free(resultMemory);
+        return 0;
+    }
+    if (options.checksums & CHECKSUM_CRC32C) {
+        crc32c_init();
+    }
+
+    /* large files are split across the pool; small ones are read sequentially */
+    WorkerPool pool;
+    WorkerPool *splitPool = NULL;
+    if (worker_count(INT_MAX) > 1 && pool_start(&pool, worker_count(INT_MAX)) == 0) {
+        splitPool = &pool;
+    }
+
+    XorCache cache;
+    if (options.cachePath != NULL) {
+        xor_cache_open(&cache, options.cachePath);
+    }
+
+    /* the walk gets its own threads: xor_file_parallel waits for everything on splitPool */
+    PathFeed feed;
+    path_feed_start(&feed, fileCount, files, NULL);
+    const char *path;
+    while ((path = path_feed_next(&feed)) != NULL) {
+        uint64_t totalBytes = 0;
+        uint8_t firstByte = 0;
+
+        /* only regular files have a stable identity to cache on, and only blocks up to 8 bytes fit */
+        struct stat st;
+        int cacheable = options.cachePath != NULL && strcmp(path, "-") != 0 &&
+                        stat(path, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0;
+        const XorCacheEntry *cached[MAX_XOR_WIDTHS] = {0};
+        int allCached = cacheable && nCount > 0 && options.checksums == 0;
+        for (int k = 0; k < nCount && allCached; k++) {
+            cached[k] = ns[k] <= 6 ? xor_cache_lookup(&cache, &st, ns[k]) : NULL;
+            allCached = cached[k] != NULL;
+        }
+        if (allCached) {
+            for (int k = 0; k < nCount; k++) {
+                result_xor(stdout, path, ns[k], cached[k]->value, cached[k]->length, nCount > 1);
+            }
+            continue;
+        }
+
+        if (acc != NULL) {
+            memset(acc, 0, folder.width);
+        }
+        Checksums sums;
+        checksums_init(&sums, options.checksums);
+        int status = xor_file(path, &folder, splitPool, acc, &sums, &totalBytes, &firstByte);
+        if (status == -1) {
+            result_error(stdout, path, "Unable to access file %s\n");
+            continue;
+        }
+        if (status == -2) {
+            result_error(stdout, path, "File read error occurred in %s\n");
+        }
+
+        if (totalBytes == 0 && nCount > 0) {
+            result_error(stdout, path, "No data in %s\n");
+        }
+        for (int k = 0; k < nCount && totalBytes > 0; k++) {
+            int N = ns[k];
+            size_t blockSizeBytes = BLOCK_SIZE_BYTES(N);
+            xor_reduce(acc, folder.width, resultMemory, blockSizeBytes);
+            if (N == 2) {
+                /* xor2 has always dropped the high nibble of the first byte */
+                resultMemory[0] = (resultMemory[0] ^ (resultMemory[0] >> 4) ^ (firstByte >> 4)) & 0x0F;
+            }
+            result_xor(stdout, path, N, resultMemory, blockSizeBytes, nCount > 1);
+            if (cacheable && status == 0 && N <= 6) {
+                xor_cache_store(&cache, &st, N, resultMemory, blockSizeBytes);
+            }
+        }
+        if (sums.kinds & CHECKSUM_CRC32C) {
+            result_checksum(stdout, path, CHECKSUM_CRC32C, sums.crc);
+        }
+        if (sums.kinds & CHECKSUM_XXH64) {
+            result_checksum(stdout, path, CHECKSUM_XXH64, xxh64_digest(&sums.xxh));
+        }
+    }
+    path_feed_destroy(&feed);
+
+    if (options.cachePath != NULL) {
+        xor_cache_save(&cache, options.cacheCompact);
+        xor_cache_close(&cache);
+    }
+    if (splitPool != NULL) {
+        pool_stop(splitPool);
+    }
+    free(acc);
+    free(resultMemory);
+    return 0;
+}
+
+typedef uint64_t (*mask_count_fn)(const uint8_t *data, size_t words, uint64_t mask);
+
+static uint64_t mask_count_scalar(const uint8_t *data, size_t words, uint64_t mask) {
+    uint64_t fits = 0;
+    for (size_t i = 0; i < words; i++) {
+        uint32_t value;
+        memcpy(&value, data + i * sizeof(uint32_t), sizeof(uint32_t));
+        fits += (value & mask) == mask;
+    }
+    return fits;
+}
+
+#ifdef HAVE_X86
+__attribute__((target("sse2")))
+static uint64_t mask_count_sse2(const uint8_t *data, size_t words, uint64_t mask) {
+    __m128i maskVector = _mm_set1_epi32((int)mask);
+    uint64_t fits = 0;
+    size_t i = 0;
+    for (; i + 4 <= words; i += 4) {
+        __m128i value = _mm_loadu_si128((const __m128i *)(data + i * sizeof(uint32_t)));
+        __m128i hit = _mm_cmpeq_epi32(_mm_and_si128(value, maskVector), maskVector);
+        fits += (uint64_t)__builtin_popcount((unsigned)_mm_movemask_ps(_mm_castsi128_ps(hit)));
+    }
+    return fits + mask_count_scalar(data + i * sizeof(uint32_t), words - i, mask);
+}
+
+__attribute__((target("avx2,popcnt")))
+static uint64_t mask_count_avx2(const uint8_t *data, size_t words, uint64_t mask) {
+    __m256i maskVector = _mm256_set1_epi32((int)mask);
+    uint64_t fits = 0;
+    size_t i = 0;
+    for (; i + 16 <= words; i += 16) {
+        const uint8_t *p = data + i * sizeof(uint32_t);
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)p);
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(p + 32));
+        __m256i h0 = _mm256_cmpeq_epi32(_mm256_and_si256(v0, maskVector), maskVector);
+        __m256i h1 = _mm256_cmpeq_epi32(_mm256_and_si256(v1, maskVector), maskVector);
+        unsigned bits = (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(h0)) |
+                        ((unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(h1)) << 8);
+        fits += (uint64_t)__builtin_popcount(bits);
+    }
+    return fits + mask_count_scalar(data + i * sizeof(uint32_t), words - i, mask);
+}
+
+__attribute__((target("avx512f,popcnt")))
+static uint64_t mask_count_avx512(const uint8_t *data, size_t words, uint64_t mask) {
+    __m512i maskVector = _mm512_set1_epi32((int)mask);
+    uint64_t fits = 0;
+    size_t i = 0;
+    for (; i + 32 <= words; i += 32) {
+        const uint8_t *p = data + i * sizeof(uint32_t);
+        __m512i v0 = _mm512_loadu_si512((const void *)p);
+        __m512i v1 = _mm512_loadu_si512((const void *)(p + 64));
+        __mmask16 h0 = _mm512_cmpeq_epi32_mask(_mm512_and_si512(v0, maskVector), maskVector);
+        __mmask16 h1 = _mm512_cmpeq_epi32_mask(_mm512_and_si512(v1, maskVector), maskVector);
+        fits += (uint64_t)__builtin_popcount(((unsigned)h1 << 16) | (unsigned)h0);
+    }
+    return fits + mask_count_scalar(data + i * sizeof(uint32_t), words - i, mask);
+}
+#endif
+
+static mask_count_fn select_mask_count(void) {
+#ifdef HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("popcnt")) {
+        return mask_count_avx512;
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        return mask_count_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return mask_count_sse2;
+    }
+#endif
+    return mask_count_scalar;
+}
+
+/*
+ * Kernels for every word width and byte order, generated at compile time.
+ * The mask is converted to the file's byte order once, so the hot loop is
+ * a plain AND/compare on raw words that GCC vector extensions lower to the
+ * widest registers the target allows. Lane counters are int-sized per word
+ * width and get flushed every 127 vectors so 8-bit lanes cannot wrap.
+ */
+typedef uint64_t (*word_load_fn)(const uint8_t *data);
+
+#define WORD_SAME(x) (x)
+
+#define MASK_WORD_KERNEL(suffix, type, laneType, toFile, toHost) \
+static uint64_t load_##suffix(const uint8_t *data) { \
+    type value; \
+    memcpy(&value, data, sizeof(type)); \
+    return (uint64_t)toHost(value); \
+} \
+static inline __attribute__((always_inline)) \
+uint64_t mask_words_##suffix##_body(const uint8_t *data, size_t words, uint64_t wideMask) { \
+    typedef type lanes_t __attribute__((vector_size(64))); \
+    typedef laneType hits_t __attribute__((vector_size(64))); \
+    const size_t perVector = 64 / sizeof(type); \
+    type mask = toFile((type)wideMask); \
+    lanes_t maskVector = (lanes_t){0} + mask; \
+    uint64_t fits = 0; \
+    size_t i = 0; \
+    while (i + perVector <= words) { \
+        hits_t acc = {0}; \
+        for (int round = 0; round < 127 && i + perVector <= words; round++, i += perVector) { \
+            lanes_t value; \
+            memcpy(&value, data + i * sizeof(type), sizeof(value)); \
+            acc -= (value & maskVector) == maskVector; \
+        } \
+        for (size_t l = 0; l < perVector; l++) { \
+            fits += (uint64_t)acc[l]; \
+        } \
+    } \
+    for (; i < words; i++) { \
+        type value; \
+        memcpy(&value, data + i * sizeof(type), sizeof(type)); \
+        fits += (type)(value & mask) == mask; \
+    } \
+    return fits; \
+} \
+static uint64_t mask_words_##suffix(const uint8_t *data, size_t words, uint64_t mask) { \
+    return mask_words_##suffix##_body(data, words, mask); \
+}
+
+#define MASK_WORD_KERNEL_AVX2(suffix) \
+__attribute__((target("avx2"))) \
+static uint64_t mask_words_##suffix##_avx2(const uint8_t *data, size_t words, uint64_t mask) { \
+    return mask_words_##suffix##_body(data, words, mask); \
+}
+
+/* single bytes have no byte order, so both 8-bit entries share one kernel */
+MASK_WORD_KERNEL(u8, uint8_t, int8_t, WORD_SAME, WORD_SAME)
+MASK_WORD_KERNEL(le16, uint16_t, int16_t, htole16, le16toh)
+MASK_WORD_KERNEL(be16, uint16_t, int16_t, htobe16, be16toh)
+MASK_WORD_KERNEL(le32, uint32_t, int32_t, htole32, le32toh)
+MASK_WORD_KERNEL(be32, uint32_t, int32_t, htobe32, be32toh)
+MASK_WORD_KERNEL(le64, uint64_t, int64_t, htole64, le64toh)
+MASK_WORD_KERNEL(be64, uint64_t, int64_t, htobe64, be64toh)
+
+#ifdef HAVE_X86
+MASK_WORD_KERNEL_AVX2(u8)
+MASK_WORD_KERNEL_AVX2(le16)
+MASK_WORD_KERNEL_AVX2(be16)
+MASK_WORD_KERNEL_AVX2(le32)
+MASK_WORD_KERNEL_AVX2(be32)
+MASK_WORD_KERNEL_AVX2(le64)
+MASK_WORD_KERNEL_AVX2(be64)
+#endif
+
+/* indexed by log2(width in bytes), then little = 0 / big = 1 */
+static const word_load_fn wordLoaders[4][2] = {
+    { load_u8, load_u8 }, { load_le16, load_be16 }, { load_le32, load_be32 }, { load_le64, load_be64 },
+};
+
+static mask_count_fn select_mask_words(int wordBits, int bigEndian) {
+    int width = __builtin_ctz((unsigned)wordBits / 8);
+    /* native 32-bit words keep the hand-written popcount kernels */
+    if (wordBits == 32 && bigEndian == (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)) {
+        return select_mask_count();
+    }
+#ifdef HAVE_X86
+    static const mask_count_fn avx2Kernels[4][2] = {
+        { mask_words_u8_avx2, mask_words_u8_avx2 }, { mask_words_le16_avx2, mask_words_be16_avx2 },
+        { mask_words_le32_avx2, mask_words_be32_avx2 }, { mask_words_le64_avx2, mask_words_be64_avx2 },
+    };
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return avx2Kernels[width][bigEndian];
+    }
+#endif
+    static const mask_count_fn kernels[4][2] = {
+        { mask_words_u8, mask_words_u8 }, { mask_words_le16, mask_words_be16 },
+        { mask_words_le32, mask_words_be32 }, { mask_words_le64, mask_words_be64 },
+    };
+    return kernels[width][bigEndian];
+}
+
+/*
+ * Bit-sliced mask index, written next to a file as <file>.midx. The words
+ * are cut into chunks of MASK_INDEX_CHUNK_WORDS and, for every chunk and bit
+ * position, the index keeps the set of words that have the bit set, stored
+ * the way roaring bitmaps do: nothing for an empty or full set, a sorted
+ * array of 16-bit positions up to MASK_INDEX_ARRAY_MAX entries, otherwise a
+ * plain bitmap. A mask query ANDs the sets of its bits chunk by chunk and
+ * never reads the data file. Since every bit is kept, listed matches get
+ * their values back from the index as well.
+ *
+ * The file is a header, a directory of chunks * wordBits containers and the
+ * container payloads, native byte order, so it is mapped as is. An index is
+ * only used while the file's inode, size and mtime match the ones recorded.
+ */
+#define MASK_INDEX_MAGIC "2MASKIDX"
+#define MASK_INDEX_VERSION 1
+#define MASK_INDEX_SUFFIX ".midx"
+#define MASK_INDEX_CHUNK_WORDS 65536
+#define MASK_INDEX_BITMAP_WORDS (MASK_INDEX_CHUNK_WORDS / 64)
+#define MASK_INDEX_ARRAY_MAX 4096
+
+enum { MASK_CONTAINER_EMPTY, MASK_CONTAINER_FULL, MASK_CONTAINER_ARRAY, MASK_CONTAINER_BITMAP };
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint8_t wordBits;
+    uint8_t bigEndian;
+    uint8_t reserved[2];
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtimeNs;
+    uint64_t words;
+    uint64_t chunks;
+} MaskIndexHeader;
+
+typedef struct {
+    uint64_t offset;
+    uint32_t cardinality;
+    uint32_t type;
+} MaskContainer;
+
+typedef struct {
+    void *map;
+    size_t mapLength;
+    const MaskIndexHeader *header;
+    const MaskContainer *containers;
+} MaskIndex;
+
+static int is_mask_index_path(const char *path) {
+    size_t length = strlen(path);
+    size_t suffixLength = strlen(MASK_INDEX_SUFFIX);
+    return length > suffixLength && strcmp(path + length - suffixLength, MASK_INDEX_SUFFIX) == 0;
+}
+
+static void mask_index_key(MaskIndexHeader *header, const struct stat *st) {
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, MASK_INDEX_MAGIC, sizeof(header->magic));
+    header->version = MASK_INDEX_VERSION;
+    header->wordBits = (uint8_t)options.wordBits;
+    header->bigEndian = (uint8_t)options.bigEndian;
+    header->dev = (uint64_t)st->st_dev;
+    header->ino = (uint64_t)st->st_ino;
+    header->size = (uint64_t)st->st_size;
+    header->mtimeNs = (int64_t)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+/*
+ * Slicers turn 64 words into one 64-bit slice per bit position: bit j of
+ * slice b is bit b of word j. The portable one transposes 8x8 bit blocks
+ * with 64-bit shifts; with AVX2 each movemask collects one bit of 8 words.
+ */
+typedef void (*mask_slice_fn)(const uint64_t *values, int wordBits, uint64_t *bitmaps, size_t group);
+
+static uint64_t transpose_8x8(uint64_t x) {
+    uint64_t t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+    x ^= t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+    x ^= t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+    return x ^ t ^ (t << 28);
+}
+
+static void mask_slice_scalar(const uint64_t *values, int wordBits, uint64_t *bitmaps, size_t group) {
+    uint64_t slices[64] = {0};
+    for (int k = 0; k < wordBits / 8; k++) {
+        for (int eighth = 0; eighth < 8; eighth++) {
+            uint64_t block = 0;
+            for (int j = 0; j < 8; j++) {
+                block |= ((values[eighth * 8 + j] >> (8 * k)) & 0xFF) << (8 * j);
+            }
+            block = transpose_8x8(block);
+            for (int t = 0; t < 8; t++) {
+                slices[8 * k + t] |= ((block >> (8 * t)) & 0xFF) << (8 * eighth);
+            }
+        }
+    }
+    for (int b = 0; b < wordBits; b++) {
+        bitmaps[(size_t)b * MASK_INDEX_BITMAP_WORDS + group] = slices[b];
+    }
+}
+
+#ifdef HAVE_X86
+/* words up to 32 bits: the top bit of every lane is collected, then the lanes are doubled */
+__attribute__((target("avx2")))
+static void mask_slice_avx2(const uint64_t *values, int wordBits, uint64_t *bitmaps, size_t group) {
+    uint32_t lanes[64] __attribute__((aligned(32)));
+    for (int j = 0; j < 64; j++) {
+        lanes[j] = (uint32_t)values[j] << (32 - wordBits);
+    }
+    __m256i words[8];
+    for (int i = 0; i < 8; i++) {
+        words[i] = _mm256_load_si256((const __m256i *)(lanes + 8 * i));
+    }
+    for (int b = wordBits - 1; b >= 0; b--) {
+        uint64_t slice = 0;
+        for (int i = 0; i < 8; i++) {
+            slice |= (uint64_t)(uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(words[i])) << (8 * i);
+            words[i] = _mm256_add_epi32(words[i], words[i]);
+        }
+        bitmaps[(size_t)b * MASK_INDEX_BITMAP_WORDS + group] = slice;
+    }
+}
+#endif
+
+static mask_slice_fn select_mask_slice(int wordBits) {
+#ifdef HAVE_X86
+    __builtin_cpu_init();
+    if (wordBits <= 32 && __builtin_cpu_supports("avx2")) {
+        return mask_slice_avx2;
+    }
+#else
+    (void)wordBits;
+#endif
+    return mask_slice_scalar;
+}
+
+/* Writes the containers of one chunk from its per-bit bitmaps and records them in directory. */
+static int mask_index_write_chunk(FILE *out, uint64_t *offset, const uint64_t *bitmaps, int wordBits,
+                                  size_t chunkWords, MaskContainer *directory) {
+    for (int b = 0; b < wordBits; b++) {
+        const uint64_t *bitmap = bitmaps + (size_t)b * MASK_INDEX_BITMAP_WORDS;
+        uint32_t cardinality = 0;
+        for (size_t w = 0; w < MASK_INDEX_BITMAP_WORDS; w++) {
+            cardinality += (uint32_t)__builtin_popcountll(bitmap[w]);
+        }
+        MaskContainer *container = &directory[b];
+        container->offset = *offset;
+        container->cardinality = cardinality;
+        if (cardinality == 0) {
+            container->type = MASK_CONTAINER_EMPTY;
+        } else if (cardinality == chunkWords) {
+            container->type = MASK_CONTAINER_FULL;
+        } else if (cardinality <= MASK_INDEX_ARRAY_MAX) {
+            uint16_t positions[MASK_INDEX_ARRAY_MAX + 3] = {0};
+            uint32_t count = 0;
+            for (size_t w = 0; w < MASK_INDEX_BITMAP_WORDS; w++) {
+                for (uint64_t bits = bitmap[w]; bits != 0; bits &= bits - 1) {
+                    positions[count++] = (uint16_t)(w * 64 + (size_t)__builtin_ctzll(bits));
+                }
+            }
+            /* payloads stay 8-byte aligned so bitmaps can be read in place */
+            size_t padded = (count + 3) & ~(size_t)3;
+            container->type = MASK_CONTAINER_ARRAY;
+            if (fwrite(positions, sizeof(uint16_t), padded, out) != padded) {
+                return -1;
+            }
+            *offset += padded * sizeof(uint16_t);
+        } else {
+            container->type = MASK_CONTAINER_BITMAP;
+            if (fwrite(bitmap, sizeof(uint64_t), MASK_INDEX_BITMAP_WORDS, out) != MASK_INDEX_BITMAP_WORDS) {
+                return -1;
+            }
+            *offset += MASK_INDEX_BITMAP_WORDS * sizeof(uint64_t);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Builds the index of path with the current word width and byte order.
+ * Returns 0, -1 when the file cannot be opened, -2 on a read error or a
+ * file that changed meanwhile, -3 when the index cannot be written.
+ */
+static int mask_index_build(const char *path, uint64_t *words, uint64_t *indexBytes) {
+    size_t wordSize = (size_t)options.wordBits / 8;
+    word_load_fn loadWord = wordLoaders[__builtin_ctz((unsigned)wordSize)][options.bigEndian];
+    mask_slice_fn slice = select_mask_slice(options.wordBits);
+    InputReader reader;
+    struct stat st;
+    if (strcmp(path, "-") == 0 || input_open(&reader, path, options.ioBackend) != 0) {
+        return -1;
+    }
+    if (fstat(reader.fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        input_close(&reader);
+        return -1;
+    }
+    MaskIndexHeader header;
+    mask_index_key(&header, &st);
+    header.words = header.size / wordSize;
+    header.chunks = (header.words + MASK_INDEX_CHUNK_WORDS - 1) / MASK_INDEX_CHUNK_WORDS;
+
+    size_t chunkBytes = MASK_INDEX_CHUNK_WORDS * wordSize;
+    size_t directoryCount = (size_t)header.chunks * (size_t)options.wordBits;
+    uint8_t *staging = (uint8_t *)malloc(chunkBytes);
+    uint64_t *bitmaps = (uint64_t *)malloc((size_t)options.wordBits * MASK_INDEX_BITMAP_WORDS * sizeof(uint64_t));
+    MaskContainer *directory = (MaskContainer *)calloc(directoryCount ? directoryCount : 1, sizeof(MaskContainer));
+    char indexPath[PATH_MAX];
+    char tempPath[PATH_MAX + 8];
+    int named = snprintf(indexPath, sizeof(indexPath), "%s%s", path, MASK_INDEX_SUFFIX) < (int)sizeof(indexPath);
+    snprintf(tempPath, sizeof(tempPath), "%s.XXXXXX", indexPath);
+    int fd = named && staging && bitmaps && directory ? mkstemp(tempPath) : -1;
+    FILE *out = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (out == NULL) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(tempPath);
+        }
+        free(staging);
+        free(bitmaps);
+        free(directory);
+        input_close(&reader);
+        return -3;
+    }
+    fchmod(fd, 0644);
+
+    /* payloads follow the directory, which is written last once their offsets are known */
+    uint64_t offset = sizeof(header) + directoryCount * sizeof(MaskContainer);
+    int status = fseek(out, (long)offset, SEEK_SET) != 0 ? -3 : 0;
+    uint64_t chunk = 0;
+    uint64_t totalBytes = 0;
+    size_t staged = 0;
+    const uint8_t *data;
+    ssize_t bytesRead = 0;
+    while (status == 0) {
+        bytesRead = input_next(&reader, &data);
+        if (bytesRead < 0) {
+            status = -2;
+            break;
+        }
+        totalBytes += (uint64_t)bytesRead;
+        size_t used = 0;
+        /* a chunk is sliced once it is complete, or at the end with whatever whole words are left */
+        while (status == 0 && (used < (size_t)bytesRead || (bytesRead == 0 && staged >= wordSize))) {
+            size_t take = chunkBytes - staged < (size_t)bytesRead - used ? chunkBytes - staged : (size_t)bytesRead - used;
+            memcpy(staging + staged, data + used, take);
+            staged += take;
+            used += take;
+            if (staged < chunkBytes && bytesRead > 0) {
+                break;
+            }
+            size_t chunkWords = staged / wordSize;
+            if (chunk == header.chunks) {
+                status = -2;
+                break;
+            }
+            for (size_t group = 0; group < MASK_INDEX_BITMAP_WORDS; group++) {
+                uint64_t values[64];
+                for (size_t j = 0; j < 64; j++) {
+                    size_t word = group * 64 + j;
+                    values[j] = word < chunkWords ? loadWord(staging + word * wordSize) : 0;
+                }
+                slice(values, options.wordBits, bitmaps, group);
+            }
+            if (mask_index_write_chunk(out, &offset, bitmaps, options.wordBits, chunkWords,
+                                       directory + chunk * (uint64_t)options.wordBits) != 0) {
+                status = -3;
+            }
+            chunk++;
+            staged = 0;
+        }
+        if (bytesRead == 0) {
+            break;
+        }
+    }
+
+    struct stat after;
+    if (status == 0 && (chunk != header.chunks || totalBytes != header.size || fstat(reader.fd, &after) != 0 ||
+                        after.st_size != st.st_size || after.st_mtim.tv_sec != st.st_mtim.tv_sec ||
+                        after.st_mtim.tv_nsec != st.st_mtim.tv_nsec)) {
+        status = -2;
+    }
+    input_close(&reader);
+    if (status == 0) {
+        int failed = fseek(out, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, out) != 1 ||
+                     fwrite(directory, sizeof(MaskContainer), directoryCount, out) != directoryCount;
+        failed |= fflush(out) != 0 || fsync(fd) != 0;
+        status = failed ? -3 : 0;
+    }
+    if (fclose(out) != 0 && status == 0) {
+        status = -3;
+    }
+    if (status == 0 && rename(tempPath, indexPath) != 0) {
+        status = -3;
+    }
+    if (status != 0) {
+        unlink(tempPath);
+    }
+    *words = header.words;
+    *indexBytes = offset;
+    free(staging);
+    free(bitmaps);
+    free(directory);
+    return status;
+}
+
+static void mask_index_task(FileJob *job, const char *path, FILE *out) {
+    (void)job;
+    /* walked trees hold the indexes of earlier runs */
+    if (is_mask_index_path(path)) {
+        return;
+    }
+    uint64_t words = 0;
+    uint64_t indexBytes = 0;
+    int status = mask_index_build(path, &words, &indexBytes);
+    if (status == -1) {
+        result_error(out, path, "Cannot index %s: not a readable regular file\n");
+    } else if (status == -2) {
+        result_error(out, path, "File read error occurred in %s (or it changed while being indexed)\n");
+    } else if (status == -3) {
+        result_error(out, path, "Cannot write the index of %s\n");
+    } else {
+        result_mask_index(out, path, words, indexBytes);
+    }
+}
+
+int mask_index_files(int fileCount, char *files[]) {
+    /* indexes land next to their files, so a walked tree is listed completely first */
+    FileJob job = { .files = files, .run = mask_index_task, .listFirst = 1 };
+    run_file_tasks(&job, fileCount);
+    return 0;
+}
+
+/* Maps the index of path; fails when it is missing, damaged, stale or built for other words. */
+static int mask_index_open(MaskIndex *index, const char *path) {
+    memset(index, 0, sizeof(*index));
+    char indexPath[PATH_MAX];
+    snprintf(indexPath, sizeof(indexPath), "%s%s", path, MASK_INDEX_SUFFIX);
+    struct stat st;
+    struct stat indexSt;
+    if (stat(path, &st) != 0) {
+        return -1;
+    }
+    int fd = open(indexPath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    void *map = fstat(fd, &indexSt) != 0 || (size_t)indexSt.st_size < sizeof(MaskIndexHeader) ? MAP_FAILED
+              : mmap(NULL, (size_t)indexSt.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    const MaskIndexHeader *header = (const MaskIndexHeader *)map;
+    MaskIndexHeader expected;
+    mask_index_key(&expected, &st);
+    size_t wordSize = (size_t)options.wordBits / 8;
+    size_t length = (size_t)indexSt.st_size;
+    size_t directoryCount = (size_t)header->chunks * (size_t)options.wordBits;
+    int valid = memcmp(header, &expected, offsetof(MaskIndexHeader, words)) == 0 &&
+                header->words == header->size / wordSize &&
+                header->chunks == (header->words + MASK_INDEX_CHUNK_WORDS - 1) / MASK_INDEX_CHUNK_WORDS &&
+                directoryCount <= (length - sizeof(MaskIndexHeader)) / sizeof(MaskContainer);
+    const MaskContainer *containers = (const MaskContainer *)(header + 1);
+    for (size_t i = 0; valid && i < directoryCount; i++) {
+        uint64_t chunkWords = header->words - (i / (size_t)options.wordBits) * MASK_INDEX_CHUNK_WORDS;
+        chunkWords = chunkWords < MASK_INDEX_CHUNK_WORDS ? chunkWords : MASK_INDEX_CHUNK_WORDS;
+        const MaskContainer *c = &containers[i];
+        uint64_t payload = c->type == MASK_CONTAINER_ARRAY ? c->cardinality * sizeof(uint16_t)
+                         : c->type == MASK_CONTAINER_BITMAP ? MASK_INDEX_BITMAP_WORDS * sizeof(uint64_t) : 0;
+        valid = c->type <= MASK_CONTAINER_BITMAP && c->offset % 8 == 0 && c->offset <= length &&
+                payload <= length - c->offset && c->cardinality <= chunkWords &&
+                (c->type != MASK_CONTAINER_ARRAY || c->cardinality <= MASK_INDEX_ARRAY_MAX);
+    }
+    if (!valid) {
+        munmap(map, length);
+        return -1;
+    }
+    index->map = map;
+    index->mapLength = length;
+    index->header = header;
+    index->containers = containers;
+    return 0;
+}
+
+static void mask_index_close(MaskIndex *index) {
+    if (index->map != NULL) {
+        munmap(index->map, index->mapLength);
+    }
+}
+
+static const void *mask_container_data(const MaskIndex *index, const MaskContainer *container) {
+    return (const uint8_t *)index->map + container->offset;
+}
+
+static int mask_container_has(const MaskIndex *index, const MaskContainer *container, uint32_t position) {
+    if (container->type == MASK_CONTAINER_FULL) {
+        return 1;
+    }
+    if (container->type == MASK_CONTAINER_BITMAP) {
+        const uint64_t *bitmap = (const uint64_t *)mask_container_data(index, container);
+        return (int)((bitmap[position / 64] >> (position % 64)) & 1);
+    }
+    const uint16_t *positions = (const uint16_t *)mask_container_data(index, container);
+    uint32_t low = 0;
+    uint32_t high = container->type == MASK_CONTAINER_ARRAY ? container->cardinality : 0;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (positions[mid] == position) {
+            return 1;
+        }
+        if (positions[mid] < position) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return 0;
+}
+
+static int mask_container_order(const void *a, const void *b) {
+    uint32_t x = (*(const MaskContainer *const *)a)->cardinality;
+    uint32_t y = (*(const MaskContainer *const *)b)->cardinality;
+    return x < y ? -1 : x > y;
+}
+
+/* Fills hits with the words of one chunk that match mask and returns how many there are. */
+static uint64_t mask_index_chunk(const MaskIndex *index, uint64_t chunk, uint64_t mask, uint64_t *hits) {
+    const MaskContainer *directory = index->containers + chunk * index->header->wordBits;
+    uint64_t chunkWords = index->header->words - chunk * MASK_INDEX_CHUNK_WORDS;
+    chunkWords = chunkWords < MASK_INDEX_CHUNK_WORDS ? chunkWords : MASK_INDEX_CHUNK_WORDS;
+    const MaskContainer *sets[64];
+    int setCount = 0;
+    for (uint64_t bits = mask; bits != 0; bits &= bits - 1) {
+        const MaskContainer *container = &directory[__builtin_ctzll(bits)];
+        if (container->type == MASK_CONTAINER_EMPTY) {
+            memset(hits, 0, MASK_INDEX_BITMAP_WORDS * sizeof(uint64_t));
+            return 0;
+        }
+        if (container->type != MASK_CONTAINER_FULL) {
+            sets[setCount++] = container;
+        }
+    }
+    if (setCount == 0) {
+        memset(hits, 0, MASK_INDEX_BITMAP_WORDS * sizeof(uint64_t));
+        memset(hits, 0xFF, (size_t)(chunkWords / 64) * sizeof(uint64_t));
+        if (chunkWords % 64 != 0) {
+            hits[chunkWords / 64] = (UINT64_C(1) << (chunkWords % 64)) - 1;
+        }
+        return chunkWords;
+    }
+    /* the smallest set drives: arrays are probed position by position, bitmaps ANDed whole */
+    qsort(sets, (size_t)setCount, sizeof(sets[0]), mask_container_order);
+    uint64_t count = 0;
+    if (sets[0]->type == MASK_CONTAINER_ARRAY) {
+        memset(hits, 0, MASK_INDEX_BITMAP_WORDS * sizeof(uint64_t));
+        const uint16_t *positions = (const uint16_t *)mask_container_data(index, sets[0]);
+        for (uint32_t i = 0; i < sets[0]->cardinality; i++) {
+            int all = 1;
+            for (int s = 1; s < setCount && all; s++) {
+                all = mask_container_has(index, sets[s], positions[i]);
+            }
+            if (all) {
+                hits[positions[i] / 64] |= UINT64_C(1) << (positions[i] % 64);
+                count++;
+            }
+        }
+        return count;
+    }
+    memcpy(hits, mask_container_data(index, sets[0]), MASK_INDEX_BITMAP_WORDS * sizeof(uint64_t));
+    for (int s = 1; s < setCount; s++) {
+        const uint64_t *bitmap = (const uint64_t *)mask_container_data(index, sets[s]);
+        for (size_t w = 0; w < MASK_INDEX_BITMAP_WORDS; w++) {
+            hits[w] &= bitmap[w];
+        }
+    }
+    for (size_t w = 0; w < MASK_INDEX_BITMAP_WORDS; w++) {
+        count += (uint64_t)__builtin_popcountll(hits[w]);
+    }
+    return count;
+}
+
+/* Rebuilds the word at position of chunk from its bit slices. */
+static uint64_t mask_index_value(const MaskIndex *index, uint64_t chunk, uint32_t position) {
+    const MaskContainer *directory = index->containers + chunk * index->header->wordBits;
+    uint64_t value = 0;
+    for (int b = 0; b < index->header->wordBits; b++) {
+        if (mask_container_has(index, &directory[b], position)) {
+            value |= UINT64_C(1) << b;
+        }
+    }
+    return value;
+}
+
+/* Adds, for every bit, how many words flagged in matched have it set. */
+static void mask_index_histogram(const MaskIndex *index, uint64_t chunk, const uint64_t *matched, uint64_t *bits) {
+    const MaskContainer *directory = index->containers + chunk * index->header->wordBits;
+    for (int b = 0; b < 32; b++) {
+        const MaskContainer *container = &directory[b];
+        uint64_t count = 0;
+        if (container->type == MASK_CONTAINER_ARRAY) {
+            const uint16_t *positions = (const uint16_t *)mask_container_data(index, container);
+            for (uint32_t i = 0; i < container->cardinality; i++) {
+                count += (matched[positions[i] / 64] >> (positions[i] % 64)) & 1;
+            }
+        } else if (container->type != MASK_CONTAINER_EMPTY) {
+            const uint64_t *bitmap = container->type == MASK_CONTAINER_BITMAP
+                                   ? (const uint64_t *)mask_container_data(index, container) : NULL;
+            for (size_t w = 0; w < MASK_INDEX_BITMAP_WORDS; w++) {
+                count += (uint64_t)__builtin_popcountll(matched[w] & (bitmap ? bitmap[w] : UINT64_MAX));
+            }
+        }
+        bits[b] += count;
+    }
+}
+
+/*
+ * Answers a mask query for path from its index with the same output as a
+ * scan. multi selects the mask-set lines; bits, for 32-bit words only,
+ * receives the histogram of words matching any mask. Returns -1 without
+ * printing anything when there is no usable index.
+ */
+static int mask_index_answer(const char *path, const uint64_t *masks, int maskCount, int multi,
+                             uint64_t listLimit, uint64_t *bits) {
+    MaskIndex index;
+    if (mask_index_open(&index, path) != 0) {
+        return -1;
+    }
+    /* one hit bitmap per mask, then the union of them */
+    uint64_t *hits = (uint64_t *)malloc((size_t)(maskCount + 1) * MASK_INDEX_BITMAP_WORDS * sizeof(uint64_t));
+    if (hits == NULL) {
+        mask_index_close(&index);
+        return -1;
+    }
+    uint64_t *matched = hits + (size_t)maskCount * MASK_INDEX_BITMAP_WORDS;
+    if (multi) {
+        result_mask_set_begin(stdout, path, maskCount);
+    } else {
+        result_mask_begin(stdout, path, masks[0]);
+    }
+    size_t wordSize = (size_t)options.wordBits / 8;
+    uint64_t counts[MAX_MASKS] = {0};
+    uint64_t listed = 0;
+    for (uint64_t chunk = 0; chunk < index.header->chunks; chunk++) {
+        int keep = listed < listLimit || bits != NULL;
+        uint64_t any = 0;
+        for (int m = 0; m < maskCount; m++) {
+            uint64_t found = mask_index_chunk(&index, chunk, masks[m], hits + (size_t)(keep ? m : 0) * MASK_INDEX_BITMAP_WORDS);
+            counts[m] += found;
+            any |= found;
+        }
+        if (!keep || any == 0) {
+            continue;
+        }
+        memcpy(matched, hits, MASK_INDEX_BITMAP_WORDS * sizeof(uint64_t));
+        for (int m = 1; m < maskCount; m++) {
+            for (size_t w = 0; w < MASK_INDEX_BITMAP_WORDS; w++) {
+                matched[w] |= hits[(size_t)m * MASK_INDEX_BITMAP_WORDS + w];
+            }
+        }
+        if (bits != NULL) {
+            mask_index_histogram(&index, chunk, matched, bits);
+        }
+        /* matches are listed in file order, every mask of a word in mask order, as a scan does */
+        for (size_t w = 0; w < MASK_INDEX_BITMAP_WORDS && listed < listLimit; w++) {
+            for (uint64_t pending = matched[w]; pending != 0 && listed < listLimit; pending &= pending - 1) {
+                uint32_t position = (uint32_t)(w * 64 + (size_t)__builtin_ctzll(pending));
+                uint64_t value = mask_index_value(&index, chunk, position);
+                uint64_t offset = (chunk * MASK_INDEX_CHUNK_WORDS + position) * wordSize;
+                for (int m = 0; m < maskCount && listed < listLimit; m++) {
+                    if ((hits[(size_t)m * MASK_INDEX_BITMAP_WORDS + w] >> (position % 64)) & 1) {
+                        result_mask_match(stdout, path, value, masks[m], offset);
+                        listed++;
+                    }
+                }
+            }
+        }
+    }
+    for (int m = 0; m < maskCount; m++) {
+        result_mask_count(stdout, path, masks[m], counts[m], multi);
+    }
+    if (bits != NULL) {
+        result_mask_histogram(stdout, path, bits);
+    }
+    free(hits);
+    mask_index_close(&index);
+    return 0;
+}
+
+int count_mask_fits(int fileCount, char *files[], uint64_t mask) {
+    mask_count_fn countWords = select_mask_words(options.wordBits, options.bigEndian);
+    word_load_fn loadWord = wordLoaders[__builtin_ctz((unsigned)options.wordBits / 8)][options.bigEndian];
+    size_t wordSize = (size_t)options.wordBits / 8;
+    PathFeed feed;
+    path_feed_start(&feed, fileCount, files, NULL);
+    const char *path;
+    while ((path = path_feed_next(&feed)) != NULL) {
+        if (options.maskIndex && (is_mask_index_path(path) ||
+                                  mask_index_answer(path, &mask, 1, 0, options.maskListLimit, NULL) == 0)) {
+            continue;
+        }
+        InputReader reader;
+        if (input_open(&reader, path, options.ioBackend) != 0) {
+            result_error(stdout, path, "Could not open file");
+            continue;
+        }
+
+        uint64_t fits = 0;
+        uint64_t listed = 0;
+        uint64_t offset = 0;
+
+        result_mask_begin(stdout, path, mask);
+
+        const uint8_t *chunk;
+        ssize_t bytesRead;
+        while ((bytesRead = input_next(&reader, &chunk)) > 0) {
+            size_t words = (size_t)bytesRead / wordSize;
+            size_t i = 0;
+            /* list matches one by one until the listing cap, then only count */
+            for (; i < words && listed < options.maskListLimit; i++) {
+                uint64_t value = loadWord(chunk + i * wordSize);
+                uint64_t maskedValue = value & mask;
+                if (maskedValue == mask) {
+                    result_mask_match(stdout, path, value, mask, offset + i * wordSize);
+                    listed = listed + 1;
+                    fits = fits + 1;
+                }
+            }
+            fits += countWords(chunk + i * wordSize, words - i, mask);
+            offset += (uint64_t)bytesRead;
+        }
+        if (bytesRead < 0) {
+            result_error(stdout, path, "File read error occurred in %s\n");
+        }
+
+        result_mask_count(stdout, path, mask, fits, 0);
+        input_close(&reader);
+    }
+    path_feed_destroy(&feed);
+
+    return 0;
+}
+
+/*
+ * Mask sets are evaluated in one pass: the masks sit in vector lanes, each
+ * word is broadcast against all of them and hits are summed in per-lane
+ * 32-bit counters that are widened every MASK_FLUSH_WORDS words.
+ */
+#define MASK_FLUSH_WORDS (1 << 20)
+
+typedef struct {
+    uint32_t masks[MAX_MASKS] __attribute__((aligned(64)));
+    int count;
+} MaskSet;
+
+static MaskSet maskSet;
+
+static int mask_set_add(MaskSet *set, const char *hex) {
+    char *endptr;
+    unsigned long mask = strtoul(hex, &endptr, 16);
+    if (*hex == '\0' || *endptr != '\0' || mask > UINT32_MAX) {
+        printf("Error: Invalid hexadecimal mask: %s\n", hex);
+        return -1;
+    }
+    if (set->count == MAX_MASKS) {
+        printf("Too many masks\n");
+        return -1;
+    }
+    set->masks[set->count++] = (uint32_t)mask;
+    return 0;
+}
+
+/* One hex mask per line; blank lines and lines starting with # are skipped. */
+static int mask_set_load(MaskSet *set, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        printf("Error opening mask file %s\n", path);
+        return -1;
+    }
+    char *line = NULL;
+    size_t len = 0;
+    ssize_t read;
+    int status = 0;
+    while (status == 0 && (read = getline(&line, &len, file)) != -1) {
+        while (read > 0 && (line[read - 1] == '\n' || line[read - 1] == '\r' || line[read - 1] == ' ')) {
+            line[--read] = '\0';
+        }
+        if (read > 0 && line[0] != '#') {
+            status = mask_set_add(set, line);
+        }
+    }
+    free(line);
+    fclose(file);
+    return status;
+}
+
+static void mask_histogram_add(uint64_t *bits, uint32_t value) {
+    while (value != 0) {
+        bits[__builtin_ctz(value)]++;
+        value &= value - 1;
+    }
+}
+
+/* counts has one slot per mask; bits is NULL unless the histogram was requested */
+typedef void (*mask_set_fn)(const uint8_t *data, size_t words, const MaskSet *set, uint64_t *counts, uint64_t *bits);
+
+static void mask_set_scalar(const uint8_t *data, size_t words, const MaskSet *set, uint64_t *counts, uint64_t *bits) {
+    for (size_t i = 0; i < words; i++) {
+        uint32_t value;
+        memcpy(&value, data + i * sizeof(uint32_t), sizeof(uint32_t));
+        int any = 0;
+        for (int m = 0; m < set->count; m++) {
+            int hit = (value & set->masks[m]) == set->masks[m];
+            counts[m] += hit;
+            any |= hit;
+        }
+        if (bits != NULL && any) {
+            mask_histogram_add(bits, value);
+        }
+    }
+}
+
+#ifdef HAVE_X86
+/* lanes past set->count repeat the first mask, so "any" stays exact; their counters are never read */
+#define MASK_SET_KERNEL(name, isa, vec, lanes, load, set1, hitMask, anyHit, addHit, storeCounts) \
+__attribute__((target(isa))) \
+static void name(const uint8_t *data, size_t words, const MaskSet *set, uint64_t *counts, uint64_t *bits) { \
+    int groups = (set->count + lanes - 1) / lanes; \
+    vec masks[MAX_MASKS / lanes]; \
+    vec acc[MAX_MASKS / lanes]; \
+    uint32_t lanesOut[lanes] __attribute__((aligned(64))); \
+    for (int g = 0; g < groups; g++) { \
+        uint32_t padded[lanes] __attribute__((aligned(64))); \
+        for (int l = 0; l < lanes; l++) { \
+            padded[l] = set->masks[g * lanes + l < set->count ? g * lanes + l : 0]; \
+        } \
+        masks[g] = load(padded); \
+    } \
+    for (size_t start = 0; start < words; start += MASK_FLUSH_WORDS) { \
+        size_t end = words - start < MASK_FLUSH_WORDS ? words : start + MASK_FLUSH_WORDS; \
+        for (int g = 0; g < groups; g++) { \
+            acc[g] = set1(0); \
+        } \
+        for (size_t i = start; i < end; i++) { \
+            uint32_t value; \
+            memcpy(&value, data + i * sizeof(uint32_t), sizeof(uint32_t)); \
+            vec broadcast = set1((int)value); \
+            int any = 0; \
+            for (int g = 0; g < groups; g++) { \
+                hitMask(hit, broadcast, masks[g]); \
+                addHit(acc[g], hit); \
+                any |= anyHit(hit); \
+            } \
+            if (bits != NULL && any) { \
+                mask_histogram_add(bits, value); \
+            } \
+        } \
+        for (int g = 0; g < groups; g++) { \
+            storeCounts(lanesOut, acc[g]); \
+            for (int l = 0; l < lanes && g * lanes + l < set->count; l++) { \
+                counts[g * lanes + l] += lanesOut[l]; \
+            } \
+        } \
+    } \
+}
+
+#define SSE2_HIT(hit, v, m) __m128i hit = _mm_cmpeq_epi32(_mm_and_si128(v, m), m)
+#define SSE2_ANY(hit) _mm_movemask_epi8(hit)
+#define SSE2_ADD(acc, hit) acc = _mm_sub_epi32(acc, hit)
+#define SSE2_STORE(out, acc) _mm_store_si128((__m128i *)(out), acc)
+#define SSE2_LOAD(p) _mm_load_si128((const __m128i *)(p))
+MASK_SET_KERNEL(mask_set_sse2, "sse2", __m128i, 4, SSE2_LOAD, _mm_set1_epi32, SSE2_HIT, SSE2_ANY, SSE2_ADD, SSE2_STORE)
+
+#define AVX2_HIT(hit, v, m) __m256i hit = _mm256_cmpeq_epi32(_mm256_and_si256(v, m), m)
+#define AVX2_ANY(hit) _mm256_movemask_epi8(hit)
+#define AVX2_ADD(acc, hit) acc = _mm256_sub_epi32(acc, hit)
+#define AVX2_STORE(out, acc) _mm256_store_si256((__m256i *)(out), acc)
+#define AVX2_LOAD(p) _mm256_load_si256((const __m256i *)(p))
+MASK_SET_KERNEL(mask_set_avx2, "avx2", __m256i, 8, AVX2_LOAD, _mm256_set1_epi32, AVX2_HIT, AVX2_ANY, AVX2_ADD, AVX2_STORE)
+
+#define AVX512_HIT(hit, v, m) __mmask16 hit = _mm512_cmpeq_epi32_mask(_mm512_and_si512(v, m), m)
+#define AVX512_ANY(hit) (int)(hit)
+#define AVX512_ADD(acc, hit) acc = _mm512_mask_sub_epi32(acc, hit, acc, _mm512_set1_epi32(-1))
+#define AVX512_STORE(out, acc) _mm512_store_si512((void *)(out), acc)
+#define AVX512_LOAD(p) _mm512_load_si512((const void *)(p))
+MASK_SET_KERNEL(mask_set_avx512, "avx512f", __m512i, 16, AVX512_LOAD, _mm512_set1_epi32, AVX512_HIT, AVX512_ANY, AVX512_ADD, AVX512_STORE)
+#endif
+
+static mask_set_fn select_mask_set(void) {
+#ifdef HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return mask_set_avx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return mask_set_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return mask_set_sse2;
+    }
+#endif
+    return mask_set_scalar;
+}
+
+int count_mask_set(int fileCount, char *files[], const MaskSet *set) {
+    if (options.wordBits != 32 || options.bigEndian != (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)) {
+        printf("Error: mask sets work on native 32-bit words only\n");
+        return -1;
+    }
+    mask_set_fn countWords = select_mask_set();
+    /* a mask set lists nothing unless --first asked for it */
+    uint64_t listLimit = options.maskListLimit == UINT64_MAX ? 0 : options.maskListLimit;
+    PathFeed feed;
+    path_feed_start(&feed, fileCount, files, NULL);
+    const char *path;
+    uint64_t masks[MAX_MASKS];
+    for (int m = 0; m < set->count; m++) {
+        masks[m] = set->masks[m];
+    }
+    while ((path = path_feed_next(&feed)) != NULL) {
+        uint64_t bits[32] = {0};
+        if (options.maskIndex && (is_mask_index_path(path) ||
+                                  mask_index_answer(path, masks, set->count, 1, listLimit,
+                                                    options.maskHistogram ? bits : NULL) == 0)) {
+            continue;
+        }
+        InputReader reader;
+        if (input_open(&reader, path, options.ioBackend) != 0) {
+            result_error(stdout, path, "Could not open file");
+            continue;
+        }
+
+        uint64_t counts[MAX_MASKS] = {0};
+        uint64_t *histogram = options.maskHistogram ? bits : NULL;
+        uint64_t listed = 0;
+        uint64_t offset = 0;
+
+        result_mask_set_begin(stdout, path, set->count);
+
+        const uint8_t *chunk;
+        ssize_t bytesRead;
+        while ((bytesRead = input_next(&reader, &chunk)) > 0) {
+            size_t words = (size_t)bytesRead / sizeof(uint32_t);
+            size_t i = 0;
+            for (; i < words && listed < listLimit; i++) {
+                uint32_t value;
+                memcpy(&value, chunk + i * sizeof(uint32_t), sizeof(uint32_t));
+                int any = 0;
+                for (int m = 0; m < set->count; m++) {
+                    if ((value & set->masks[m]) != set->masks[m]) {
+                        continue;
+                    }
+                    if (listed < listLimit) {
+                        result_mask_match(stdout, path, value, set->masks[m], offset + i * sizeof(uint32_t));
+                        listed++;
+                    }
+                    counts[m]++;
+                    any = 1;
+                }
+                if (histogram != NULL && any) {
+                    mask_histogram_add(histogram, value);
+                }
+            }
+            countWords(chunk + i * sizeof(uint32_t), words - i, set, counts, histogram);
+            offset += (uint64_t)bytesRead;
+        }
+        if (bytesRead < 0) {
+            result_error(stdout, path, "File read error occurred in %s\n");
+        }
+
+        for (int m = 0; m < set->count; m++) {
+            result_mask_count(stdout, path, set->masks[m], counts[m], 1);
+        }
+        if (histogram != NULL) {
+            result_mask_histogram(stdout, path, histogram);
+        }
+        input_close(&reader);
+    }
+    path_feed_destroy(&feed);
+    return 0;
+}
+
+static void copy_target_name(const char *source, int copyIdx, char *target, size_t targetSize) {
+    const char *slash = strrchr(source, '/');
+    const char *dot = strrchr(slash ? slash + 1 : source, '.');
+    if (dot) {
+        snprintf(target, targetSize, "%.*s_%d%s", (int)(dot - source), source, copyIdx + 1, dot);
+    } else {
+        snprintf(target, targetSize, "%s_%d", source, copyIdx + 1);
+    }
+}
+
+/* A byte range of the source that holds data; everything between extents is a hole. */
+typedef struct {
+    off_t offset;
+    off_t length;
+} CopyExtent;
+
+/*
+ * Lists the data extents of a regular file with SEEK_DATA/SEEK_HOLE. A
+ * filesystem that cannot report holes yields one extent covering the whole
+ * file. Returns NULL only when out of memory.
+ */
+static CopyExtent *copy_data_extents(int fd, off_t size, size_t *count) {
+    size_t capacity = 16;
+    CopyExtent *extents = (CopyExtent *)malloc(capacity * sizeof(CopyExtent));
+    *count = 0;
+    if (extents == NULL) {
+        return NULL;
+    }
+    off_t offset = 0;
+    while (offset < size) {
+        off_t data = lseek(fd, offset, SEEK_DATA);
+        if (data < 0 && errno == ENXIO) {
+            break; /* only a hole is left */
+        }
+        if (data < 0) {
+            extents[0].offset = 0;
+            extents[0].length = size;
+            *count = 1;
+            return extents;
+        }
+        if (data >= size) {
+            break;
+        }
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0 || hole > size) {
+            hole = size;
+        }
+        if (*count == capacity) {
+            CopyExtent *grown = (CopyExtent *)realloc(extents, 2 * capacity * sizeof(CopyExtent));
+            if (grown == NULL) {
+                free(extents);
+                return NULL;
+            }
+            extents = grown;
+            capacity *= 2;
+        }
+        extents[*count].offset = data;
+        extents[*count].length = hole - data;
+        (*count)++;
+        offset = hole;
+    }
+    return extents;
+}
+
+/*
+ * Sizes a destination like the source, leaving holes where the source has
+ * them, and reserves the data extents up front so the copy lands in few
+ * contiguous pieces. Preallocation is only a hint where unsupported, but
+ * running out of space fails the copy before any data is written.
+ */
+static int copy_layout(int destFd, off_t size, const CopyExtent *extents, size_t count) {
+    if (ftruncate(destFd, size) != 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (fallocate(destFd, 0, extents[i].offset, extents[i].length) != 0) {
+            if (errno == EOPNOTSUPP || errno == ENOSYS) {
+                break;
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Kernel copy paths return 0 on success, 1 if unsupported before any byte moved, -1 on failure. */
+static int copy_with_reflink(int sourceFd, int destFd) {
+#ifdef FICLONE
+    if (ioctl(destFd, FICLONE, sourceFd) == 0) {
+        return 0;
+    }
+#endif
+    return 1;
+}
+
+static int copy_with_range(int sourceFd, int destFd, const CopyExtent *extents, size_t count) {
+    int moved = 0;
+    for (size_t i = 0; i < count; i++) {
+        loff_t inOffset = extents[i].offset;
+        loff_t outOffset = extents[i].offset;
+        loff_t end = extents[i].offset + extents[i].length;
+        while (inOffset < end) {
+            ssize_t bytes = copy_file_range(sourceFd, &inOffset, destFd, &outOffset, (size_t)(end - inOffset), 0);
+            if (bytes < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return moved ? -1 : 1;
+            }
+            if (bytes == 0) {
+                /* the source shrank: the destination is already sized, so a partial copy must not pass */
+                return moved ? -1 : 1;
+            }
+            moved = 1;
+        }
+    }
+    return 0;
+}
+
+static int copy_with_sendfile(int sourceFd, int destFd, const CopyExtent *extents, size_t count) {
+    int moved = 0;
+    for (size_t i = 0; i < count; i++) {
+        off_t offset = extents[i].offset;
+        off_t end = extents[i].offset + extents[i].length;
+        if (lseek(destFd, offset, SEEK_SET) < 0) {
+            return moved ? -1 : 1;
+        }
+        while (offset < end) {
+            ssize_t bytes = sendfile(destFd, sourceFd, &offset, (size_t)(end - offset));
+            if (bytes < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return moved ? -1 : 1;
+            }
+            if (bytes == 0) {
+                /* the source shrank: the destination is already sized, so a partial copy must not pass */
+                return moved ? -1 : 1;
+            }
+            moved = 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * io_uring copy: every chunk is one read into a registered buffer linked to
+ * one write per destination, so the source is read once and up to depth
+ * chains are in flight. Writes are hard-linked so a failing destination
+ * does not cancel the others. Only data extents are read, so holes stay holes.
+ */
+typedef struct {
+    Uring ring;
+    uint8_t *buffers;
+    int fixed;
+    int sourceFd;
+    const int *destFds;
+    int destCount;
+    uint8_t *failed;
+    int sourceFailed;
+    const CopyExtent *extents;
+    size_t extentCount;
+    size_t extentIndex;
+    uint64_t nextOffset;
+    size_t slotLength[256];
+    int slotRemaining[256];
+} UringCopy;
+
+#define URING_COPY_READ 0xFF
+
+static int uring_copy_queue(UringCopy *copy, int slot) {
+    int live = 0;
+    for (int i = 0; i < copy->destCount; i++) {
+        live += !copy->failed[i];
+    }
+    /* chunks never span a hole; the next extent starts a fresh chunk */
+    while (copy->extentIndex < copy->extentCount &&
+           copy->nextOffset >= (uint64_t)(copy->extents[copy->extentIndex].offset + copy->extents[copy->extentIndex].length)) {
+        if (++copy->extentIndex < copy->extentCount) {
+            copy->nextOffset = (uint64_t)copy->extents[copy->extentIndex].offset;
+        }
+    }
+    if (copy->sourceFailed || copy->extentIndex >= copy->extentCount || live == 0) {
+        return 0;
+    }
+    uint8_t *buffer = copy->buffers + (size_t)slot * INPUT_BUFFER_SIZE;
+    uint64_t extentEnd = (uint64_t)(copy->extents[copy->extentIndex].offset + copy->extents[copy->extentIndex].length);
+    size_t length = extentEnd - copy->nextOffset < INPUT_BUFFER_SIZE ? (size_t)(extentEnd - copy->nextOffset) : INPUT_BUFFER_SIZE;
+    int bufferIndex = copy->fixed ? slot : -1;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&copy->ring);
+    uring_prep_rw(sqe, IORING_OP_READ, copy->sourceFd, buffer, length, copy->nextOffset, bufferIndex,
+                  ((uint64_t)slot << 8) | URING_COPY_READ);
+    sqe->flags = IOSQE_IO_LINK;
+    for (int i = 0; i < copy->destCount; i++) {
+        if (copy->failed[i]) {
+            continue;
+        }
+        sqe = uring_get_sqe(&copy->ring);
+        uring_prep_rw(sqe, IORING_OP_WRITE, copy->destFds[i], buffer, length, copy->nextOffset, bufferIndex,
+                      ((uint64_t)slot << 8) | (uint64_t)i);
+        if (--live > 0) {
+            sqe->flags = IOSQE_IO_HARDLINK;
+        }
+    }
+    copy->slotLength[slot] = length;
+    copy->slotRemaining[slot] = 1;
+    for (int i = 0; i < copy->destCount; i++) {
+        copy->slotRemaining[slot] += !copy->failed[i];
+    }
+    copy->nextOffset += length;
+    return 1;
+}
+
+/* Returns 1 if io_uring is unavailable; otherwise 0 with failed[i] set for every broken destination. */
+static int copy_fanout_uring(int sourceFd, const CopyExtent *extents, size_t extentCount,
+                             const int *destFds, int destCount, uint8_t *failed) {
+    UringCopy copy;
+    memset(&copy, 0, sizeof(copy));
+    int depth = options.queueDepth;
+    if (uring_init(&copy.ring, (unsigned)(depth * (destCount + 1))) != 0) {
+        return 1;
+    }
+    copy.buffers = (uint8_t *)aligned_alloc(4096, (size_t)depth * INPUT_BUFFER_SIZE);
+    if (copy.buffers == NULL) {
+        uring_exit(&copy.ring);
+        return 1;
+    }
+    copy.fixed = uring_register_buffers(&copy.ring, copy.buffers, INPUT_BUFFER_SIZE, (unsigned)depth) == 0;
+    copy.sourceFd = sourceFd;
+    copy.destFds = destFds;
+    copy.destCount = destCount;
+    copy.failed = failed;
+    copy.extents = extents;
+    copy.extentCount = extentCount;
+    copy.nextOffset = extentCount > 0 ? (uint64_t)extents[0].offset : 0;
+
+    int active = 0;
+    for (int slot = 0; slot < depth; slot++) {
+        active += uring_copy_queue(&copy, slot);
+    }
+    while (active > 0) {
+        struct io_uring_cqe *cqe;
+        if (uring_wait_cqe(&copy.ring, &cqe) != 0) {
+            copy.sourceFailed = 1;
+            break;
+        }
+        int slot = (int)(cqe->user_data >> 8);
+        int op = (int)(cqe->user_data & 0xFF);
+        if (cqe->res < 0 || (size_t)cqe->res != copy.slotLength[slot]) {
+            if (op == URING_COPY_READ) {
+                copy.sourceFailed = 1;
+            } else {
+                failed[op] = 1;
+            }
+        }
+        uring_cqe_seen(&copy.ring);
+        if (--copy.slotRemaining[slot] == 0) {
+            active--;
+            active += uring_copy_queue(&copy, slot);
+        }
+    }
+    if (copy.sourceFailed) {
+        memset(failed, 1, destCount);
+    }
+    uring_exit(&copy.ring);
+    free(copy.buffers);
+    return 0;
+}
+
+/* Userspace fan-out over the data extents of a sparse source; returns the number of failed copies. */
+static int copy_fanout_extents(int sourceFd, const CopyExtent *extents, size_t extentCount,
+                               int *destFds, const int *pending, int pendingCount) {
+    uint8_t *buffer = (uint8_t *)malloc(INPUT_BUFFER_SIZE);
+    if (buffer == NULL) {
+        return pendingCount;
+    }
+    int failures = 0;
+    int sourceFailed = 0;
+    for (size_t e = 0; e < extentCount && !sourceFailed; e++) {
+        off_t offset = extents[e].offset;
+        off_t end = extents[e].offset + extents[e].length;
+        while (offset < end) {
+            size_t want = end - offset < INPUT_BUFFER_SIZE ? (size_t)(end - offset) : INPUT_BUFFER_SIZE;
+            ssize_t bytes = pread(sourceFd, buffer, want, offset);
+            if (bytes < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes <= 0) {
+                /* hitting end of file inside an extent means the source shrank */
+                sourceFailed = 1;
+                break;
+            }
+            for (int i = 0; i < pendingCount; i++) {
+                int fd = destFds[pending[i]];
+                if (fd >= 0 && pwrite_all(fd, buffer, (size_t)bytes, offset) != 0) {
+                    close(fd);
+                    destFds[pending[i]] = -1;
+                    failures++;
+                }
+            }
+            offset += bytes;
+        }
+    }
+    if (sourceFailed) {
+        for (int i = 0; i < pendingCount; i++) {
+            if (destFds[pending[i]] >= 0) {
+                failures++;
+            }
+        }
+    }
+    free(buffer);
+    return failures;
+}
+
+/* Makes N copies of one source and returns the number of copies that failed. */
+static int copy_file_fanout(const char *source, int N, FILE *out) {
+    int sourceFd = open(source, O_RDONLY);
+    if (sourceFd < 0) {
+        result_error(out, source, "Error opening source file: %s\n");
+        return N;
+    }
+    struct stat st;
+    int regular = fstat(sourceFd, &st) == 0 && S_ISREG(st.st_mode);
+
+    /* every path below copies only the data extents; a dense file is one extent */
+    CopyExtent whole = { 0, regular ? st.st_size : 0 };
+    size_t extentCount = 1;
+    CopyExtent *extents = regular ? copy_data_extents(sourceFd, st.st_size, &extentCount) : NULL;
+    if (extents == NULL) {
+        extents = &whole;
+        extentCount = 1;
+    }
+    off_t dataBytes = 0;
+    for (size_t i = 0; i < extentCount; i++) {
+        dataBytes += extents[i].length;
+    }
+    int sparse = regular && dataBytes < st.st_size;
+
+    int destFds[MAX_N];
+    int pending[MAX_N];
+    int pendingCount = 0;
+    int failures = 0;
+
+    for (int copyIdx = 0; copyIdx < N; copyIdx++) {
+        char newFilename[PATH_MAX];
+        copy_target_name(source, copyIdx, newFilename, sizeof(newFilename));
+        destFds[copyIdx] = open(newFilename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (destFds[copyIdx] < 0) {
+            result_error(out, newFilename, "Error opening dest file: %s\n");
+            failures++;
+            continue;
+        }
+
+        /* cheapest first: reflink, copy_file_range, sendfile; --io=uring tries only the reflink before its own chains */
+        int status = 1;
+        if (regular) {
+            status = copy_with_reflink(sourceFd, destFds[copyIdx]);
+            if (status == 1 && copy_layout(destFds[copyIdx], st.st_size, extents, extentCount) != 0) {
+                result_error(out, newFilename, "Error preallocating dest file: %s\n");
+                status = -1;
+            }
+            if (status == 1 && options.ioBackend != IO_URING) {
+                status = copy_with_range(sourceFd, destFds[copyIdx], extents, extentCount);
+            }
+            if (status == 1 && options.ioBackend != IO_URING) {
+                status = copy_with_sendfile(sourceFd, destFds[copyIdx], extents, extentCount);
+            }
+        }
+        if (status == 1) {
+            pending[pendingCount++] = copyIdx;
+        } else if (status < 0) {
+            failures++;
+        }
+    }
+
+    if (pendingCount > 0 && regular && options.ioBackend == IO_URING) {
+        int pendingFds[MAX_N];
+        uint8_t failed[MAX_N] = {0};
+        for (int i = 0; i < pendingCount; i++) {
+            pendingFds[i] = destFds[pending[i]];
+        }
+        if (copy_fanout_uring(sourceFd, extents, extentCount, pendingFds, pendingCount, failed) == 0) {
+            for (int i = 0; i < pendingCount; i++) {
+                failures += failed[i];
+            }
+            pendingCount = 0;
+        }
+    }
+
+    /* whatever the kernel could not copy is read once and fanned out */
+    if (pendingCount > 0 && sparse) {
+        failures += copy_fanout_extents(sourceFd, extents, extentCount, destFds, pending, pendingCount);
+    } else if (pendingCount > 0) {
+        InputReader reader;
+        if (input_open(&reader, source, options.ioBackend) != 0) {
+            result_error(out, source, "Error opening source file: %s\n");
+            failures += pendingCount;
+        } else {
+            const uint8_t *chunk;
+            ssize_t bytes;
+            off_t copied = 0;
+            while ((bytes = input_next(&reader, &chunk)) > 0) {
+                copied += bytes;
+                for (int i = 0; i < pendingCount; i++) {
+                    int fd = destFds[pending[i]];
+                    if (fd >= 0 && write_all(fd, chunk, (size_t)bytes) != 0) {
+                        close(fd);
+                        destFds[pending[i]] = -1;
+                        failures++;
+                    }
+                }
+            }
+            /* a regular destination was already sized, so a source that shrank must not pass either */
+            if (bytes < 0 || (regular && copied != st.st_size)) {
+                for (int i = 0; i < pendingCount; i++) {
+                    if (destFds[pending[i]] >= 0) {
+                        failures++;
+                    }
+                }
+            }
+            input_close(&reader);
+        }
+    }
+
+    for (int copyIdx = 0; copyIdx < N; copyIdx++) {
+        if (destFds[copyIdx] >= 0 && close(destFds[copyIdx]) != 0) {
+            failures++;
+        }
+    }
+    if (extents != &whole) {
+        free(extents);
+    }
+    close(sourceFd);
+    return failures;
+}
+
+static void copy_file_task(FileJob *job, const char *path, FILE *out) {
+    int failures = copy_file_fanout(path, *(const int *)job->context, out);
+    __atomic_fetch_add(&job->failures, failures, __ATOMIC_RELAXED);
+}
+
+int copyN(int fileCount, char *files[], int N) {
+    if (N > MAX_N) {
+        printf("Too big N\n");
+        return 0;
+    }
+    /* copies land next to their sources, so a walked tree is listed completely first */
+    FileJob job = { .files = files, .run = copy_file_task, .context = &N, .listFirst = 1 };
+    if (run_file_tasks(&job, fileCount) != 0) {
+        return 0;
+    }
+
+    if (job.failures > 0) {
+        result_copy_failures(stdout, job.failures);
+    }
+    return 0;
+}
+
+/*
+ * Duplicate detection in three stages, each one only looking at files that
+ * still share a group: equal sizes, then an XXH64 of the first and last
+ * DEDUPE_EDGE_BYTES, then XXH64 and CRC32C of the whole content. Files no
+ * larger than both edges are hashed whole in the second stage already.
+ * Neither hash resists deliberate collisions, so every group that survives
+ * is compared byte for byte against its first file before it is reported.
+ */
+#define DEDUPE_EDGE_BYTES 4096
+
+typedef struct {
+    const char *path;
+    const char *reference;
+    dev_t device;
+    ino_t inode;
+    uint64_t size;
+    uint64_t key[2];
+    uint32_t variant;
+    int complete;
+    int failed;
+    int verified;
+    int differs;
+} DedupeFile;
+
+static int dedupe_same(const DedupeFile *a, const DedupeFile *b) {
+    return a->size == b->size && a->key[0] == b->key[0] && a->key[1] == b->key[1] && a->variant == b->variant;
+}
+
+/* Largest files first, so the groups that waste the most space are listed first. */
+static int dedupe_compare(const void *a, const void *b) {
+    const DedupeFile *x = (const DedupeFile *)a;
+    const DedupeFile *y = (const DedupeFile *)b;
+    if (x->size != y->size) {
+        return x->size > y->size ? -1 : 1;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (x->key[i] != y->key[i]) {
+            return x->key[i] < y->key[i] ? -1 : 1;
+        }
+    }
+    if (x->variant != y->variant) {
+        return x->variant < y->variant ? -1 : 1;
+    }
+    return strcmp(x->path, y->path);
+}
+
+/* Reports and drops files a stage could not read, then keeps only groups of two or more. */
+static size_t dedupe_keep_groups(DedupeFile *files, size_t count) {
+    size_t readable = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (files[i].failed) {
+            result_error(stdout, files[i].path, "Error reading file %s\n");
+        } else {
+            files[readable++] = files[i];
+        }
+    }
+    qsort(files, readable, sizeof(DedupeFile), dedupe_compare);
+    size_t kept = 0;
+    for (size_t i = 0; i < readable;) {
+        size_t end = i + 1;
+        while (end < readable && dedupe_same(&files[i], &files[end])) {
+            end++;
+        }
+        if (end - i > 1) {
+            memmove(files + kept, files + i, (end - i) * sizeof(DedupeFile));
+            kept += end - i;
+        }
+        i = end;
+    }
+    return kept;
+}
+
+static int dedupe_inode_compare(const void *a, const void *b) {
+    const DedupeFile *x = (const DedupeFile *)a;
+    const DedupeFile *y = (const DedupeFile *)b;
+    if (x->device != y->device) {
+        return x->device < y->device ? -1 : 1;
+    }
+    if (x->inode != y->inode) {
+        return x->inode < y->inode ? -1 : 1;
+    }
+    return strcmp(x->path, y->path);
+}
+
+/*
+ * Keeps one entry per inode so a file is never reported as a duplicate of
+ * itself. Names that resolve to the same path (a file reached twice, through
+ * a repeated input or a symlink) are dropped; real hard links are listed as
+ * such and take part in the later stages under their first name only.
+ */
+static size_t dedupe_collapse_links(DedupeFile *files, size_t count, uint32_t *linkGroups) {
+    qsort(files, count, sizeof(DedupeFile), dedupe_inode_compare);
+    char **names = (char **)malloc((count > 0 ? count : 1) * sizeof(char *));
+    char **resolved = (char **)malloc((count > 0 ? count : 1) * sizeof(char *));
+    size_t kept = 0;
+    for (size_t i = 0; i < count;) {
+        size_t end = i + 1;
+        while (end < count && files[end].device == files[i].device && files[end].inode == files[i].inode) {
+            end++;
+        }
+        files[kept++] = files[i];
+        if (end - i > 1 && names != NULL && resolved != NULL) {
+            size_t distinct = 0;
+            for (size_t j = i; j < end; j++) {
+                char *real = realpath(files[j].path, NULL);
+                int seen = 0;
+                for (size_t k = 0; k < distinct && real != NULL && !seen; k++) {
+                    seen = resolved[k] != NULL && strcmp(resolved[k], real) == 0;
+                }
+                if (seen) {
+                    free(real);
+                    continue;
+                }
+                resolved[distinct] = real;
+                names[distinct++] = (char *)files[j].path;
+            }
+            if (distinct > 1) {
+                result_hard_links(stdout, (*linkGroups)++, files[i].size, names, distinct);
+            }
+            for (size_t k = 0; k < distinct; k++) {
+                free(resolved[k]);
+            }
+        }
+        i = end;
+    }
+    free(names);
+    free(resolved);
+    return kept;
+}
+
+static void dedupe_edges_task(void *arg) {
+    DedupeFile *file = (DedupeFile *)arg;
+    uint8_t buffer[2 * DEDUPE_EDGE_BYTES];
+    int whole = file->size <= sizeof(buffer);
+    size_t length = whole ? (size_t)file->size : sizeof(buffer);
+    int fd = open(file->path, O_RDONLY);
+    if (fd < 0) {
+        file->failed = 1;
+        return;
+    }
+    if (whole) {
+        file->failed = pread_all(fd, buffer, length, 0) != 0;
+    } else {
+        file->failed = pread_all(fd, buffer, DEDUPE_EDGE_BYTES, 0) != 0 ||
+                       pread_all(fd, buffer + DEDUPE_EDGE_BYTES, DEDUPE_EDGE_BYTES,
+                                 (off_t)(file->size - DEDUPE_EDGE_BYTES)) != 0;
+    }
+    close(fd);
+    Checksums sums;
+    checksums_init(&sums, whole ? CHECKSUM_CRC32C | CHECKSUM_XXH64 : CHECKSUM_XXH64);
+    checksums_update(&sums, buffer, length);
+    file->key[0] = xxh64_digest(&sums.xxh);
+    file->key[1] = sums.crc;
+    file->complete = whole;
+}
+
+static void dedupe_full_task(void *arg) {
+    DedupeFile *file = (DedupeFile *)arg;
+    InputReader reader;
+    if (input_open(&reader, file->path, options.ioBackend) != 0) {
+        file->failed = 1;
+        return;
+    }
+    Checksums sums;
+    checksums_init(&sums, CHECKSUM_CRC32C | CHECKSUM_XXH64);
+    uint64_t total = 0;
+    const uint8_t *chunk;
+    ssize_t bytes;
+    while ((bytes = input_next(&reader, &chunk)) > 0) {
+        checksums_update(&sums, chunk, (size_t)bytes);
+        total += (uint64_t)bytes;
+    }
+    input_close(&reader);
+    /* a file that changed size since it was listed cannot be trusted either way */
+    file->failed = bytes < 0 || total != file->size;
+    file->key[0] = xxh64_digest(&sums.xxh);
+    file->key[1] = sums.crc;
+    file->complete = 1;
+}
+
+static void dedupe_verify_task(void *arg) {
+    DedupeFile *file = (DedupeFile *)arg;
+    uint8_t *buffer = (uint8_t *)malloc(2 * (size_t)INPUT_BUFFER_SIZE);
+    int fd = open(file->path, O_RDONLY);
+    int referenceFd = open(file->reference, O_RDONLY);
+    file->complete = 1;
+    file->failed = buffer == NULL || fd < 0 || referenceFd < 0;
+    for (uint64_t offset = 0; offset < file->size && !file->failed && !file->differs;) {
+        size_t length = file->size - offset < INPUT_BUFFER_SIZE ? (size_t)(file->size - offset) : INPUT_BUFFER_SIZE;
+        file->failed = pread_all(fd, buffer, length, (off_t)offset) != 0 ||
+                       pread_all(referenceFd, buffer + INPUT_BUFFER_SIZE, length, (off_t)offset) != 0;
+        file->differs = !file->failed && memcmp(buffer, buffer + INPUT_BUFFER_SIZE, length) != 0;
+        offset += length;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (referenceFd >= 0) {
+        close(referenceFd);
+    }
+    free(buffer);
+}
+
+static void dedupe_stage(WorkerPool *pool, DedupeFile *files, size_t count, void (*run)(void *arg)) {
+    for (size_t i = 0; i < count; i++) {
+        if (!files[i].complete && pool_submit(pool, run, &files[i]) != 0) {
+            run(&files[i]);
+        }
+    }
+    pool_wait(pool);
+}
+
+int dedupe_files(int fileCount, char *files[]) {
+    WorkerPool pool;
+    if (pool_start(&pool, worker_count(INT_MAX)) != 0) {
+        printf("Cannot start worker threads\n");
+        return 0;
+    }
+    crc32c_init();
+
+    /* directories are still being walked on the pool while earlier files are stat'ed */
+    PathFeed feed;
+    path_feed_start(&feed, fileCount, files, &pool);
+    DedupeFile *list = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    const char *path;
+    while ((path = path_feed_next(&feed)) != NULL) {
+        struct stat st;
+        if (stat(path, &st) != 0) {
+            result_error(stdout, path, "Error opening file %s\n");
+            continue;
+        }
+        if (!S_ISREG(st.st_mode)) {
+            continue;
+        }
+        if (count == capacity) {
+            size_t grown = capacity ? capacity * 2 : 1024;
+            DedupeFile *items = (DedupeFile *)realloc(list, grown * sizeof(DedupeFile));
+            if (items == NULL) {
+                printf("Cannot allocate memory for %s\n", path);
+                continue;
+            }
+            list = items;
+            capacity = grown;
+        }
+        DedupeFile file = { .path = path, .device = st.st_dev, .inode = st.st_ino, .size = (uint64_t)st.st_size,
+                            .complete = st.st_size == 0 };
+        list[count++] = file;
+    }
+
+    uint32_t linkGroups = 0;
+    count = dedupe_collapse_links(list, count, &linkGroups);
+    count = dedupe_keep_groups(list, count);
+    dedupe_stage(&pool, list, count, dedupe_edges_task);
+    count = dedupe_keep_groups(list, count);
+    dedupe_stage(&pool, list, count, dedupe_full_task);
+    count = dedupe_keep_groups(list, count);
+
+    /* files that differ from their group's first file move to a new variant and are checked again there */
+    int split = 1;
+    while (split && count > 0) {
+        for (size_t i = 0; i < count;) {
+            size_t end = i + 1;
+            while (end < count && dedupe_same(&list[i], &list[end])) {
+                end++;
+            }
+            for (size_t j = i + 1; j < end && !list[i].verified; j++) {
+                list[j].reference = list[i].path;
+                list[j].complete = 0;
+            }
+            list[i].verified = 1;
+            i = end;
+        }
+        dedupe_stage(&pool, list, count, dedupe_verify_task);
+        split = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (list[i].differs) {
+                list[i].differs = 0;
+                list[i].verified = 0;
+                list[i].variant++;
+                split = 1;
+            } else {
+                list[i].verified = 1;
+            }
+        }
+        count = dedupe_keep_groups(list, count);
+    }
+    pool_stop(&pool);
+
+    char **names = (char **)malloc((count > 0 ? count : 1) * sizeof(char *));
+    uint32_t groups = 0;
+    for (size_t i = 0; i < count && names != NULL;) {
+        size_t end = i;
+        while (end < count && dedupe_same(&list[i], &list[end])) {
+            names[end - i] = (char *)list[end].path;
+            end++;
+        }
+        result_duplicates(stdout, groups++, list[i].size, names, end - i);
+        i = end;
+    }
+    if (options.format == FORMAT_TEXT && groups == 0) {
+        printf("No identical files found.\n");
+    }
+    fflush(stdout);
+    free(names);
+    free(list);
+    path_feed_destroy(&feed);
+    return 0;
+}
+
+typedef struct {
+    const uint8_t *pattern;
+    size_t length;
+    size_t shift[256];
+} Searcher;
+
+static void searcher_init(Searcher *searcher, const uint8_t *pattern, size_t length) {
+    searcher->pattern = pattern;
+    searcher->length = length;
+    for (int c = 0; c < 256; c++) {
+        searcher->shift[c] = length;
+    }
+    for (size_t i = 0; i + 1 < length; i++) {
+        searcher->shift[pattern[i]] = length - 1 - i;
+    }
+}
+
+/*
+ * Finds the first match starting in [from, length - pattern length]: memchr
+ * jumps to candidates for the first byte, a mismatch skips by the
+ * Horspool shift of the window's last byte.
+ */
+static const uint8_t *searcher_find(const Searcher *searcher, const uint8_t *data, size_t length, size_t from) {
+    size_t m = searcher->length;
+    if (length < m) {
+        return NULL;
+    }
+    const uint8_t *last = data + length - m;
+    const uint8_t *pos = data + from;
+    while (pos <= last) {
+        pos = (const uint8_t *)memchr(pos, searcher->pattern[0], (size_t)(last - pos) + 1);
+        if (pos == NULL) {
+            return NULL;
+        }
+        if (memcmp(pos + 1, searcher->pattern + 1, m - 1) == 0) {
+            return pos;
+        }
+        pos += searcher->shift[pos[m - 1]];
+    }
+    return NULL;
+}
+
+/*
+ * Returns the offset of the first match, -1 when there is none and -2 when
+ * the file cannot be read. With report set every match (overlapping ones
+ * included) is written there and the number of matches is returned instead.
+ */
+static int64_t search_file(const Searcher *searcher, const char *path, FILE *report, const int *cancel) {
+    InputReader reader;
+    if (input_open(&reader, path, options.ioBackend) != 0) {
+        return -2;
+    }
+    size_t keep = searcher->length - 1;
+    uint8_t *window = (uint8_t *)malloc(2 * keep + 1);
+    if (window == NULL) {
+        input_close(&reader);
+        return -2;
+    }
+
+    /* window holds the last keep bytes of the stream so far plus the head of the next chunk */
+    size_t carry = 0;
+    uint64_t chunkStart = 0;
+    int64_t result = -1;
+    uint64_t count = 0;
+    const uint8_t *chunk;
+    ssize_t bytes = 0;
+    while (result < 0 && !__atomic_load_n(cancel, __ATOMIC_RELAXED) && (bytes = input_next(&reader, &chunk)) > 0) {
+        size_t length = (size_t)bytes;
+        size_t head = length < keep ? length : keep;
+        if (carry > 0) {
+            memcpy(window + carry, chunk, head);
+            const uint8_t *hit;
+            size_t from = 0;
+            while ((hit = searcher_find(searcher, window, carry + head, from)) != NULL && (size_t)(hit - window) < carry) {
+                uint64_t offset = chunkStart - carry + (uint64_t)(hit - window);
+                if (report == NULL) {
+                    result = (int64_t)offset;
+                    break;
+                }
+                result_find_offset(report, path, NULL, offset);
+                count++;
+                from = (size_t)(hit - window) + 1;
+            }
+            if (result >= 0) {
+                break;
+            }
+        }
+        const uint8_t *hit;
+        size_t from = 0;
+        while ((hit = searcher_find(searcher, chunk, length, from)) != NULL) {
+            uint64_t offset = chunkStart + (uint64_t)(hit - chunk);
+            if (report == NULL) {
+                result = (int64_t)offset;
+                break;
+            }
+            result_find_offset(report, path, NULL, offset);
+            count++;
+            from = (size_t)(hit - chunk) + 1;
+        }
+        if (result >= 0) {
+            break;
+        }
+        if (length >= keep) {
+            memcpy(window, chunk + length - keep, keep);
+            carry = keep;
+        } else {
+            size_t total = carry + length;
+            size_t next = total < keep ? total : keep;
+            memmove(window, window + total - next, next);
+            carry = next;
+        }
+        chunkStart += length;
+    }
+    if (result < 0 && bytes < 0) {
+        result = -2;
+    } else if (report != NULL) {
+        result = (int64_t)count;
+    }
+    free(window);
+    input_close(&reader);
+    return result;
+}
+
+/* Expands \n, \t and \0 in place and returns the resulting length. */
+static size_t unescape_pattern(char *pattern) {
+    size_t in = 0;
+    size_t out = 0;
+    while (pattern[in] != '\0') {
+        if (pattern[in] == '\\') {
+            char c = pattern[in + 1];
+            if (c == 'n' || c == 't' || c == '0') {
+                pattern[out++] = c == 'n' ? '\n' : (c == 't' ? '\t' : '\0');
+                in += 2;
+                continue;
+            }
+        }
+        pattern[out++] = pattern[in++];
+    }
+    pattern[out] = '\0';
+    return out;
+}
+
+typedef struct {
+    char **items;
+    size_t *lengths;
+    int count;
+    int capacity;
+} PatternList;
+
+static PatternList patternList;
+
+static int pattern_list_add(PatternList *list, char *pattern) {
+    size_t length = unescape_pattern(pattern);
+    if (length == 0) {
+        printf("Error: Empty search string provided.\n");
+        return -1;
+    }
+    if (list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 8;
+        char **items = (char **)realloc(list->items, capacity * sizeof(char *));
+        if (items == NULL) {
+            return -1;
+        }
+        list->items = items;
+        size_t *lengths = (size_t *)realloc(list->lengths, capacity * sizeof(size_t));
+        if (lengths == NULL) {
+            return -1;
+        }
+        list->lengths = lengths;
+        list->capacity = capacity;
+    }
+    list->items[list->count] = pattern;
+    list->lengths[list->count] = length;
+    list->count++;
+    return 0;
+}
+
+/* One pattern per line; blank lines are skipped and escapes are expanded like on the command line. */
+static int pattern_list_load(PatternList *list, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        printf("Error opening pattern file %s\n", path);
+        return -1;
+    }
+    char *line = NULL;
+    size_t len = 0;
+    ssize_t read;
+    int status = 0;
+    while (status == 0 && (read = getline(&line, &len, file)) != -1) {
+        while (read > 0 && (line[read - 1] == '\n' || line[read - 1] == '\r')) {
+            line[--read] = '\0';
+        }
+        if (read == 0) {
+            continue;
+        }
+        char *pattern = strdup(line);
+        if (pattern == NULL || pattern_list_add(list, pattern) != 0) {
+            free(pattern);
+            status = -1;
+        }
+    }
+    free(line);
+    fclose(file);
+    return status;
+}
+
+#define AC_OUTPUT_FLAG 0x80000000u
+#define AC_ROW_MASK 0x7FFFFFFFu
+#define AC_NONE UINT32_MAX
+
+/*
+ * Aho-Corasick automaton compiled to a full DFA over byte classes. Bytes
+ * that occur in no pattern share class 0, so a row is only as wide as the
+ * patterns' alphabet. Entries are premultiplied row offsets; the high bit
+ * marks targets that end at least one pattern.
+ */
+typedef struct {
+    uint16_t classOf[256];
+    uint32_t classCount;
+    uint32_t stateCount;
+    uint32_t *next;
+    int32_t *output;
+    int32_t *dictLink;
+    int32_t *samePattern;
+    int patternCount;
+} AhoCorasick;
+
+static void ac_free(AhoCorasick *ac) {
+    free(ac->next);
+    free(ac->output);
+    free(ac->dictLink);
+    free(ac->samePattern);
+    memset(ac, 0, sizeof(*ac));
+}
+
+static int ac_build(AhoCorasick *ac, const PatternList *patterns) {
+    memset(ac, 0, sizeof(*ac));
+    ac->patternCount = patterns->count;
+    size_t maxStates = 1;
+    for (int p = 0; p < patterns->count; p++) {
+        const uint8_t *text = (const uint8_t *)patterns->items[p];
+        for (size_t i = 0; i < patterns->lengths[p]; i++) {
+            if (ac->classOf[text[i]] == 0) {
+                ac->classOf[text[i]] = (uint16_t)++ac->classCount;
+            }
+        }
+        maxStates += patterns->lengths[p];
+    }
+    ac->classCount++;
+    if (maxStates * ac->classCount > AC_ROW_MASK) {
+        printf("Too many patterns\n");
+        return -1;
+    }
+
+    uint32_t classes = ac->classCount;
+    ac->next = (uint32_t *)malloc(maxStates * classes * sizeof(uint32_t));
+    ac->output = (int32_t *)malloc(maxStates * sizeof(int32_t));
+    ac->dictLink = (int32_t *)malloc(maxStates * sizeof(int32_t));
+    ac->samePattern = (int32_t *)malloc(patterns->count * sizeof(int32_t));
+    uint32_t *fail = (uint32_t *)malloc(maxStates * sizeof(uint32_t));
+    uint32_t *queue = (uint32_t *)malloc(maxStates * sizeof(uint32_t));
+    if (!ac->next || !ac->output || !ac->dictLink || !ac->samePattern || !fail || !queue) {
+        printf("Cannot allocate memory for pattern automaton\n");
+        free(fail);
+        free(queue);
+        ac_free(ac);
+        return -1;
+    }
+    memset(ac->next, 0xFF, maxStates * classes * sizeof(uint32_t));
+    ac->output[0] = -1;
+    ac->dictLink[0] = -1;
+    ac->stateCount = 1;
+
+    for (int p = 0; p < patterns->count; p++) {
+        const uint8_t *text = (const uint8_t *)patterns->items[p];
+        uint32_t state = 0;
+        for (size_t i = 0; i < patterns->lengths[p]; i++) {
+            uint32_t *slot = &ac->next[state * classes + ac->classOf[text[i]]];
+            if (*slot == AC_NONE) {
+                *slot = ac->stateCount;
+                ac->output[ac->stateCount] = -1;
+                ac->dictLink[ac->stateCount] = -1;
+                ac->stateCount++;
+            }
+            state = *slot;
+        }
+        ac->samePattern[p] = ac->output[state];
+        ac->output[state] = p;
+    }
+
+    /* breadth-first: fill missing edges from the failure state and link outputs */
+    size_t head = 0;
+    size_t tail = 0;
+    for (uint32_t c = 0; c < classes; c++) {
+        uint32_t child = ac->next[c];
+        if (child == AC_NONE) {
+            ac->next[c] = 0;
+        } else {
+            fail[child] = 0;
+            queue[tail++] = child;
+        }
+    }
+    while (head < tail) {
+        uint32_t state = queue[head++];
+        for (uint32_t c = 0; c < classes; c++) {
+            uint32_t *slot = &ac->next[state * classes + c];
+            uint32_t fallback = ac->next[fail[state] * classes + c];
+            if (*slot == AC_NONE) {
+                *slot = fallback;
+            } else {
+                uint32_t child = *slot;
+                fail[child] = fallback;
+                ac->dictLink[child] = ac->output[fallback] >= 0 ? (int32_t)fallback : ac->dictLink[fallback];
+                queue[tail++] = child;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < (size_t)ac->stateCount * classes; i++) {
+        uint32_t target = ac->next[i];
+        uint32_t entry = target * classes;
+        if (ac->output[target] >= 0 || ac->dictLink[target] >= 0) {
+            entry |= AC_OUTPUT_FLAG;
+        }
+        ac->next[i] = entry;
+    }
+    free(fail);
+    free(queue);
+    return 0;
+}
+
+/* Marks every pattern ending at state; returns how many were new. */
+static int ac_collect(const AhoCorasick *ac, uint32_t state, uint8_t *found) {
+    int fresh = 0;
+    int32_t node = ac->output[state] >= 0 ? (int32_t)state : ac->dictLink[state];
+    while (node >= 0) {
+        for (int32_t p = ac->output[node]; p >= 0; p = ac->samePattern[p]) {
+            if (!found[p]) {
+                found[p] = 1;
+                fresh++;
+            }
+        }
+        node = ac->dictLink[node];
+    }
+    return fresh;
+}
+
+/*
+ * Sets found[p] for every pattern present in the file; returns the number
+ * found or -1 on error. The scan ends once every pattern was seen, or after
+ * the first one with --any.
+ */
+static int ac_search_file(const AhoCorasick *ac, const char *path, uint8_t *found, const int *cancel) {
+    InputReader reader;
+    if (input_open(&reader, path, options.ioBackend) != 0) {
+        return -1;
+    }
+    memset(found, 0, ac->patternCount);
+    int wanted = options.stopOnMatch ? 1 : ac->patternCount;
+    int foundCount = 0;
+    uint32_t row = 0;
+    const uint8_t *chunk;
+    ssize_t bytes = 0;
+    while (foundCount < wanted && !__atomic_load_n(cancel, __ATOMIC_RELAXED) &&
+           (bytes = input_next(&reader, &chunk)) > 0) {
+        for (ssize_t i = 0; i < bytes; i++) {
+            uint32_t entry = ac->next[row + ac->classOf[chunk[i]]];
+            row = entry & AC_ROW_MASK;
+            if (entry & AC_OUTPUT_FLAG) {
+                foundCount += ac_collect(ac, row / ac->classCount, found);
+                if (foundCount >= wanted) {
+                    break;
+                }
+            }
+        }
+    }
+    input_close(&reader);
+    if (foundCount < wanted && bytes < 0) {
+        return -1;
+    }
+    return foundCount;
+}
+
+/* find --all: reports every pattern occurrence with its start offset; returns the count or -1 on error. */
+static int64_t ac_report_file(const AhoCorasick *ac, const PatternList *patterns, const char *path,
+                              FILE *report, const int *cancel) {
+    InputReader reader;
+    if (input_open(&reader, path, options.ioBackend) != 0) {
+        return -1;
+    }
+    uint64_t count = 0;
+    uint64_t chunkStart = 0;
+    uint32_t row = 0;
+    const uint8_t *chunk;
+    ssize_t bytes = 0;
+    while (!__atomic_load_n(cancel, __ATOMIC_RELAXED) && (bytes = input_next(&reader, &chunk)) > 0) {
+        for (ssize_t i = 0; i < bytes; i++) {
+            uint32_t entry = ac->next[row + ac->classOf[chunk[i]]];
+            row = entry & AC_ROW_MASK;
+            if (!(entry & AC_OUTPUT_FLAG)) {
+                continue;
+            }
+            uint32_t state = row / ac->classCount;
+            uint64_t end = chunkStart + (uint64_t)i + 1;
+            for (int32_t node = ac->output[state] >= 0 ? (int32_t)state : ac->dictLink[state]; node >= 0;
+                 node = ac->dictLink[node]) {
+                for (int32_t p = ac->output[node]; p >= 0; p = ac->samePattern[p]) {
+                    result_find_offset(report, path, patterns->items[p], end - patterns->lengths[p]);
+                    count++;
+                }
+            }
+        }
+        chunkStart += (uint64_t)bytes;
+    }
+    input_close(&reader);
+    return bytes < 0 ? -1 : (int64_t)count;
+}
+
+/*
+ * Regex find. The pattern is parsed into a small AST, compiled to a Thompson
+ * NFA and run through a DFA built lazily one transition at a time, so a scan
+ * is linear in the input whatever the pattern. Supported: literals, ., [...]
+ * and [^...] with ranges, \d \w \s \D \W \S, \xHH, (), |, *, +, ?, {m},
+ * {m,}, {m,n}, and ^ / $ at line boundaries.
+ */
+#define REGEX_MAX_INSTS 20000
+#define REGEX_MAX_REPEAT 1000
+#define REGEX_MAX_DEPTH 256
+#define REGEX_PREFIX_MAX 32
+
+enum { RXN_EMPTY, RXN_SET, RXN_CAT, RXN_ALT, RXN_REPEAT, RXN_BOL, RXN_EOL };
+
+typedef struct {
+    int type;
+    int left;
+    int right;
+    int min;
+    int max; /* -1 for no upper bound */
+    uint64_t set[4];
+} RegexNode;
+
+typedef struct {
+    const uint8_t *text;
+    size_t length;
+    size_t pos;
+    RegexNode *nodes;
+    int count;
+    int capacity;
+    int depth;
+    const char *error;
+} RegexParser;
+
+static void rx_set_add(uint64_t *set, int c) {
+    set[c >> 6] |= (uint64_t)1 << (c & 63);
+}
+
+static int rx_set_has(const uint64_t *set, int c) {
+    return (int)((set[c >> 6] >> (c & 63)) & 1);
+}
+
+static void rx_set_range(uint64_t *set, int from, int to) {
+    for (int c = from; c <= to; c++) {
+        rx_set_add(set, c);
+    }
+}
+
+static int rx_node(RegexParser *parser, int type, int left, int right) {
+    if (parser->count == parser->capacity) {
+        int capacity = parser->capacity ? parser->capacity * 2 : 64;
+        RegexNode *nodes = (RegexNode *)realloc(parser->nodes, capacity * sizeof(RegexNode));
+        if (nodes == NULL) {
+            parser->error = "out of memory";
+            return -1;
+        }
+        parser->nodes = nodes;
+        parser->capacity = capacity;
+    }
+    RegexNode *node = &parser->nodes[parser->count];
+    memset(node, 0, sizeof(*node));
+    node->type = type;
+    node->left = left;
+    node->right = right;
+    return parser->count++;
+}
+
+/* Adds \d \w \s or a negation to set; returns 0 if c is not one of those letters. */
+static int rx_class_escape(int c, uint64_t *set) {
+    uint64_t class[4] = {0};
+    switch (c) {
+    case 'd':
+    case 'D':
+        rx_set_range(class, '0', '9');
+        break;
+    case 'w':
+    case 'W':
+        rx_set_range(class, '0', '9');
+        rx_set_range(class, 'A', 'Z');
+        rx_set_range(class, 'a', 'z');
+        rx_set_add(class, '_');
+        break;
+    case 's':
+    case 'S':
+        rx_set_range(class, '\t', '\r');
+        rx_set_add(class, ' ');
+        break;
+    default:
+        return 0;
+    }
+    int negate = c >= 'A' && c <= 'Z';
+    for (int i = 0; i < 4; i++) {
+        set[i] |= negate ? ~class[i] : class[i];
+    }
+    return 1;
+}
+
+static int rx_hex_digit(int c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+        return (c | 0x20) - 'a' + 10;
+    }
+    return -1;
+}
+
+/* The byte an escaped c stands for; \xHH consumes its two digits. */
+static int rx_escape_byte(RegexParser *parser, int c) {
+    switch (c) {
+    case 'n':
+        return '\n';
+    case 't':
+        return '\t';
+    case 'r':
+        return '\r';
+    case 'f':
+        return '\f';
+    case 'v':
+        return '\v';
+    case '0':
+        return 0;
+    case 'x':
+        if (parser->pos + 2 <= parser->length && rx_hex_digit(parser->text[parser->pos]) >= 0 &&
+            rx_hex_digit(parser->text[parser->pos + 1]) >= 0) {
+            int value = rx_hex_digit(parser->text[parser->pos]) * 16 + rx_hex_digit(parser->text[parser->pos + 1]);
+            parser->pos += 2;
+            return value;
+        }
+        return c;
+    default:
+        return c;
+    }
+}
+
+/* Parses the inside of [...] after the opening bracket. */
+static int rx_parse_class(RegexParser *parser, uint64_t *set) {
+    int negate = 0;
+    if (parser->pos < parser->length && parser->text[parser->pos] == '^') {
+        negate = 1;
+        parser->pos++;
+    }
+    int first = 1;
+    while (1) {
+        if (parser->pos >= parser->length) {
+            parser->error = "missing ]";
+            return -1;
+        }
+        int c = parser->text[parser->pos++];
+        if (c == ']' && !first) {
+            break;
+        }
+        first = 0;
+        if (c == '\\') {
+            if (parser->pos >= parser->length) {
+                parser->error = "trailing backslash";
+                return -1;
+            }
+            int escaped = parser->text[parser->pos++];
+            if (rx_class_escape(escaped, set)) {
+                continue;
+            }
+            c = rx_escape_byte(parser, escaped);
+        }
+        if (parser->pos + 1 < parser->length && parser->text[parser->pos] == '-' && parser->text[parser->pos + 1] != ']') {
+            parser->pos++;
+            int high = parser->text[parser->pos++];
+            if (high == '\\') {
+                if (parser->pos >= parser->length) {
+                    parser->error = "trailing backslash";
+                    return -1;
+                }
+                high = rx_escape_byte(parser, parser->text[parser->pos++]);
+            }
+            if (high < c) {
+                parser->error = "reversed range in []";
+                return -1;
+            }
+            rx_set_range(set, c, high);
+        } else {
+            rx_set_add(set, c);
+        }
+    }
+    if (negate) {
+        for (int i = 0; i < 4; i++) {
+            set[i] = ~set[i];
+        }
+    }
+    return 0;
+}
+
+static int rx_parse_alt(RegexParser *parser);
+
+static int rx_parse_atom(RegexParser *parser) {
+    int c = parser->text[parser->pos++];
+    if (c == '(') {
+        if (++parser->depth > REGEX_MAX_DEPTH) {
+            parser->error = "groups nested too deeply";
+            return -1;
+        }
+        int inner = rx_parse_alt(parser);
+        parser->depth--;
+        if (inner < 0) {
+            return -1;
+        }
+        if (parser->pos >= parser->length || parser->text[parser->pos] != ')') {
+            parser->error = "missing )";
+            return -1;
+        }
+        parser->pos++;
+        return inner;
+    }
+    if (c == '^') {
+        return rx_node(parser, RXN_BOL, -1, -1);
+    }
+    if (c == '$') {
+        return rx_node(parser, RXN_EOL, -1, -1);
+    }
+    if (c == '*' || c == '+' || c == '?') {
+        parser->error = "nothing to repeat";
+        return -1;
+    }
+    int node = rx_node(parser, RXN_SET, -1, -1);
+    if (node < 0) {
+        return -1;
+    }
+    uint64_t *set = parser->nodes[node].set;
+    if (c == '.') {
+        rx_set_range(set, 0, 255);
+        set['\n' >> 6] &= ~((uint64_t)1 << '\n');
+    } else if (c == '[') {
+        if (rx_parse_class(parser, set) != 0) {
+            return -1;
+        }
+    } else if (c == '\\') {
+        if (parser->pos >= parser->length) {
+            parser->error = "trailing backslash";
+            return -1;
+        }
+        int escaped = parser->text[parser->pos++];
+        if (!rx_class_escape(escaped, set)) {
+            rx_set_add(set, rx_escape_byte(parser, escaped));
+        }
+    } else {
+        rx_set_add(set, c);
+    }
+    return node;
+}
+
+/* Parses {m}, {m,} or {m,n}; returns 0 with nothing consumed if the brace is a literal. */
+static int rx_parse_bounds(RegexParser *parser, int *min, int *max) {
+    size_t pos = parser->pos + 1;
+    long low = 0;
+    long high;
+    size_t digits = 0;
+    while (pos < parser->length && parser->text[pos] >= '0' && parser->text[pos] <= '9' && digits < 9) {
+        low = low * 10 + (parser->text[pos++] - '0');
+        digits++;
+    }
+    if (digits == 0) {
+        return 0;
+    }
+    high = low;
+    if (pos < parser->length && parser->text[pos] == ',') {
+        pos++;
+        digits = 0;
+        high = 0;
+        while (pos < parser->length && parser->text[pos] >= '0' && parser->text[pos] <= '9' && digits < 9) {
+            high = high * 10 + (parser->text[pos++] - '0');
+            digits++;
+        }
+        if (digits == 0) {
+            high = -1;
+        }
+    }
+    if (pos >= parser->length || parser->text[pos] != '}') {
         return 0;
     }
+    parser->pos = pos + 1;
+    if (low > REGEX_MAX_REPEAT || high > REGEX_MAX_REPEAT || (high >= 0 && high < low)) {
+        parser->error = "bad repetition count";
+    }
+    *min = (int)low;
+    *max = (int)high;
+    return 1;
+}
 
-    int fileIndex = 0;
-    while (fileIndex < fileCount) {
-        FILE *fileHandle = fopen(files[fileIndex], "rb");
-        if (fileHandle == NULL) {
-            printf("Unable to access file %s\n", files[fileIndex]);
-            fileIndex++;
-            continue;
+static int rx_parse_repeat(RegexParser *parser) {
+    int node = rx_parse_atom(parser);
+    while (node >= 0 && parser->pos < parser->length) {
+        int c = parser->text[parser->pos];
+        int min;
+        int max;
+        if (c == '*' || c == '+' || c == '?') {
+            parser->pos++;
+            min = c == '+';
+            max = c == '?' ? 1 : -1;
+        } else if (c != '{' || !rx_parse_bounds(parser, &min, &max)) {
+            break;
+        }
+        if (parser->error != NULL) {
+            return -1;
+        }
+        node = rx_node(parser, RXN_REPEAT, node, -1);
+        if (node >= 0) {
+            parser->nodes[node].min = min;
+            parser->nodes[node].max = max;
+        }
+    }
+    return node;
+}
+
+static int rx_parse_cat(RegexParser *parser) {
+    int node = -1;
+    while (parser->pos < parser->length && parser->text[parser->pos] != '|' && parser->text[parser->pos] != ')') {
+        int next = rx_parse_repeat(parser);
+        if (next < 0) {
+            return -1;
+        }
+        node = node < 0 ? next : rx_node(parser, RXN_CAT, node, next);
+        if (node < 0) {
+            return -1;
+        }
+    }
+    return node < 0 ? rx_node(parser, RXN_EMPTY, -1, -1) : node;
+}
+
+static int rx_parse_alt(RegexParser *parser) {
+    int node = rx_parse_cat(parser);
+    while (node >= 0 && parser->pos < parser->length && parser->text[parser->pos] == '|') {
+        parser->pos++;
+        int right = rx_parse_cat(parser);
+        if (right < 0) {
+            return -1;
         }
+        node = rx_node(parser, RXN_ALT, node, right);
+    }
+    return node;
+}
 
-        int processedBlocks = 0;
+enum { RX_SET, RX_SPLIT, RX_JUMP, RX_MATCH, RX_BOL, RX_EOL };
 
-        while (1) {
-            size_t bytesRead = fread(blockMemory, 1, blockSizeBytes, fileHandle);
-            if (bytesRead == 0) {
-                break;
-            }
-            if (ferror(fileHandle)) {
-                printf("File read error occurred in %s\n", files[fileIndex]);
-                break;
+typedef struct {
+    int op;
+    int32_t out;
+    int32_t out1;
+    uint64_t set[4];
+} RegexInst;
+
+/*
+ * Compiled regex. start is an unanchored loop (any byte, then retry) in
+ * front of the pattern, so the DFA finds matches starting anywhere. Bytes
+ * that no instruction tells apart share a class, which keeps DFA rows short.
+ */
+typedef struct {
+    RegexInst *insts;
+    int instCount;
+    int instCapacity;
+    int32_t start;
+    int32_t match;
+    int hasBol;
+    uint16_t classOf[256];
+    uint8_t classByte[256];
+    int classCount;
+    uint8_t prefix[REGEX_PREFIX_MAX];
+    size_t prefixLength;
+} Regex;
+
+/* A fragment under construction: its entry and the chain of its unpatched exits. */
+typedef struct {
+    int32_t start;
+    int32_t holes;
+} RegexFrag;
+
+static int32_t rx_inst(Regex *regex, int op) {
+    if (regex->instCount == REGEX_MAX_INSTS) {
+        return -1;
+    }
+    if (regex->instCount == regex->instCapacity) {
+        int capacity = regex->instCapacity ? regex->instCapacity * 2 : 64;
+        RegexInst *insts = (RegexInst *)realloc(regex->insts, capacity * sizeof(RegexInst));
+        if (insts == NULL) {
+            return -1;
+        }
+        regex->insts = insts;
+        regex->instCapacity = capacity;
+    }
+    RegexInst *inst = &regex->insts[regex->instCount];
+    memset(inst, 0, sizeof(*inst));
+    inst->op = op;
+    inst->out = -1;
+    inst->out1 = -1;
+    return regex->instCount++;
+}
+
+/* Holes are encoded as inst * 2 + (0 for out, 1 for out1); each hole's field links to the next one. */
+static int32_t *rx_hole(Regex *regex, int32_t hole) {
+    return hole & 1 ? &regex->insts[hole >> 1].out1 : &regex->insts[hole >> 1].out;
+}
+
+static void rx_patch(Regex *regex, int32_t holes, int32_t target) {
+    while (holes >= 0) {
+        int32_t *field = rx_hole(regex, holes);
+        holes = *field;
+        *field = target;
+    }
+}
+
+static int32_t rx_append(Regex *regex, int32_t first, int32_t second) {
+    int32_t hole = first;
+    while (*rx_hole(regex, hole) >= 0) {
+        hole = *rx_hole(regex, hole);
+    }
+    *rx_hole(regex, hole) = second;
+    return first;
+}
+
+static RegexFrag rx_compile(Regex *regex, const RegexNode *nodes, int index);
+
+/* x{m,n} is m copies of x followed by n-m optional ones; x{m,} ends in x*. */
+static RegexFrag rx_compile_repeat(Regex *regex, const RegexNode *nodes, const RegexNode *node) {
+    RegexFrag result = { -1, -1 };
+    int copies = node->max < 0 ? node->min + 1 : node->max;
+    for (int k = 0; k < copies; k++) {
+        RegexFrag piece = rx_compile(regex, nodes, node->left);
+        if (piece.start < 0) {
+            return piece;
+        }
+        if (k >= node->min) {
+            int32_t split = rx_inst(regex, RX_SPLIT);
+            if (split < 0) {
+                piece.start = -1;
+                return piece;
             }
-            if (bytesRead < blockSizeBytes) {
-                memset(blockMemory + bytesRead, 0, blockSizeBytes - bytesRead);
+            regex->insts[split].out = piece.start;
+            if (node->max < 0) {
+                rx_patch(regex, piece.holes, split);
+                piece.holes = split * 2 + 1;
+            } else {
+                piece.holes = rx_append(regex, piece.holes, split * 2 + 1);
             }
-            if (N == 2) {
-                uint8_t byte = blockMemory[0];
-                uint8_t highNibble = (byte >> 4) & 0x0F;
-                uint8_t lowNibble = byte & 0x0F;
-
-                if (processedBlocks == 0) {
-                    resultMemory[0] = highNibble;
-                } else {
-                    resultMemory[0] ^= highNibble;
-                }
-                processedBlocks++;
+            piece.start = split;
+        }
+        if (result.start < 0) {
+            result = piece;
+        } else {
+            rx_patch(regex, result.holes, piece.start);
+            result.holes = piece.holes;
+        }
+    }
+    if (result.start < 0) {
+        result.start = rx_inst(regex, RX_JUMP);
+        result.holes = result.start >= 0 ? result.start * 2 : -1;
+    }
+    return result;
+}
 
-                if (processedBlocks == 1) {
-                    resultMemory[0] = lowNibble;
-                } else {
-                    resultMemory[0] ^= lowNibble;
-                }
-                processedBlocks++;
-            } else {
-                if (processedBlocks == 0) {
-                    memcpy(resultMemory, blockMemory, blockSizeBytes);
-                } else {
-                    for (size_t i = 0; i < blockSizeBytes; i++) {
-                        resultMemory[i] ^= blockMemory[i];
-                    }
-                }
-                processedBlocks++;
+static RegexFrag rx_compile(Regex *regex, const RegexNode *nodes, int index) {
+    const RegexNode *node = &nodes[index];
+    RegexFrag frag = { -1, -1 };
+    if (node->type == RXN_CAT || node->type == RXN_ALT) {
+        RegexFrag left = rx_compile(regex, nodes, node->left);
+        if (left.start < 0) {
+            return left;
+        }
+        RegexFrag right = rx_compile(regex, nodes, node->right);
+        if (right.start < 0) {
+            return right;
+        }
+        if (node->type == RXN_CAT) {
+            rx_patch(regex, left.holes, right.start);
+            frag.start = left.start;
+            frag.holes = right.holes;
+            return frag;
+        }
+        frag.start = rx_inst(regex, RX_SPLIT);
+        if (frag.start >= 0) {
+            regex->insts[frag.start].out = left.start;
+            regex->insts[frag.start].out1 = right.start;
+            frag.holes = rx_append(regex, left.holes, right.holes);
+        }
+        return frag;
+    }
+    if (node->type == RXN_REPEAT) {
+        return rx_compile_repeat(regex, nodes, node);
+    }
+    static const int ops[] = { [RXN_EMPTY] = RX_JUMP, [RXN_SET] = RX_SET, [RXN_BOL] = RX_BOL, [RXN_EOL] = RX_EOL };
+    frag.start = rx_inst(regex, ops[node->type]);
+    if (frag.start >= 0) {
+        memcpy(regex->insts[frag.start].set, node->set, sizeof(node->set));
+        regex->hasBol |= node->type == RXN_BOL;
+        frag.holes = frag.start * 2;
+    }
+    return frag;
+}
+
+/* Appends the literal bytes every match starts with; returns 1 while the node was all literal. */
+static int rx_literal_prefix(Regex *regex, const RegexNode *nodes, int index) {
+    const RegexNode *node = &nodes[index];
+    if (node->type == RXN_EMPTY) {
+        return 1;
+    }
+    if (node->type == RXN_CAT) {
+        return rx_literal_prefix(regex, nodes, node->left) && rx_literal_prefix(regex, nodes, node->right);
+    }
+    if (node->type != RXN_SET || regex->prefixLength == REGEX_PREFIX_MAX) {
+        return 0;
+    }
+    int only = -1;
+    for (int c = 0; c < 256; c++) {
+        if (rx_set_has(node->set, c)) {
+            if (only >= 0) {
+                return 0;
             }
+            only = c;
         }
+    }
+    if (only < 0) {
+        return 0;
+    }
+    regex->prefix[regex->prefixLength++] = (uint8_t)only;
+    return 1;
+}
 
-        if (processedBlocks == 0) {
-            printf("No data in %s\n", files[fileIndex]);
-        } else {
-            printf("Computed XOR for %s: ", files[fileIndex]);
-            if (N == 2) {
-                printf("%01x\n", resultMemory[0] & 0x0F);
-            } else {
-                for (size_t i = 0; i < blockSizeBytes; i++) {
-                    printf("%02x", resultMemory[i]);
-                }
-                printf("\n");
+/* Splits the bytes into classes no byte set distinguishes; newline always gets its own. */
+static void rx_byte_classes(Regex *regex) {
+    uint64_t newline[4] = {0};
+    rx_set_add(newline, '\n');
+    memset(regex->classOf, 0, sizeof(regex->classOf));
+    for (int i = -1; i < regex->instCount; i++) {
+        if (i >= 0 && regex->insts[i].op != RX_SET) {
+            continue;
+        }
+        const uint64_t *set = i < 0 ? newline : regex->insts[i].set;
+        int16_t remap[256][2];
+        memset(remap, -1, sizeof(remap));
+        int count = 0;
+        for (int c = 0; c < 256; c++) {
+            int16_t *slot = &remap[regex->classOf[c]][rx_set_has(set, c)];
+            if (*slot < 0) {
+                *slot = (int16_t)count++;
             }
+            regex->classOf[c] = (uint16_t)*slot;
         }
+        regex->classCount = count;
+    }
+    for (int c = 255; c >= 0; c--) {
+        regex->classByte[regex->classOf[c]] = (uint8_t)c;
+    }
+}
+
+static void regex_free(Regex *regex) {
+    free(regex->insts);
+    regex->insts = NULL;
+}
 
-        fclose(fileHandle);
-        fileIndex++;
+static int regex_build(Regex *regex, const char *pattern, size_t length) {
+    memset(regex, 0, sizeof(*regex));
+    RegexParser parser;
+    memset(&parser, 0, sizeof(parser));
+    parser.text = (const uint8_t *)pattern;
+    parser.length = length;
+    int root = rx_parse_alt(&parser);
+    if (root >= 0 && parser.pos < length) {
+        parser.error = "unmatched )";
+        root = -1;
+    }
+    if (root < 0) {
+        printf("Error: Invalid regex '%s': %s\n", pattern, parser.error);
+        free(parser.nodes);
+        return -1;
+    }
+    /* compiling recurses down the CAT/ALT chains, and a CAT node emits no instruction of its own */
+    if (parser.count > 2 * REGEX_MAX_INSTS) {
+        printf("Error: Regex '%s' is too large\n", pattern);
+        free(parser.nodes);
+        return -1;
     }
+    RegexFrag body = rx_compile(regex, parser.nodes, root);
+    rx_literal_prefix(regex, parser.nodes, root);
+    free(parser.nodes);
 
-    free(blockMemory);
-    free(resultMemory);
+    regex->match = rx_inst(regex, RX_MATCH);
+    int32_t any = rx_inst(regex, RX_SET);
+    regex->start = rx_inst(regex, RX_SPLIT);
+    if (body.start < 0 || regex->match < 0 || any < 0 || regex->start < 0) {
+        printf("Error: Regex '%s' is too large\n", pattern);
+        regex_free(regex);
+        return -1;
+    }
+    rx_patch(regex, body.holes, regex->match);
+    memset(regex->insts[any].set, 0xFF, sizeof(regex->insts[any].set));
+    regex->insts[any].out = regex->start;
+    regex->insts[regex->start].out = body.start;
+    regex->insts[regex->start].out1 = any;
+    rx_byte_classes(regex);
     return 0;
 }
 
-int count_mask_fits(int fileCount, char *files[], uint32_t mask) {
-    int currFileIndex = 0;
-    while (currFileIndex < fileCount) {
-        FILE *file_p = fopen(files[currFileIndex], "rb");
-        if (file_p == NULL) {
-            printf("Could not open file");
-            currFileIndex = currFileIndex + 1;
-            continue;
-        }
+/*
+ * Lazy DFA over a compiled Regex. A state is the sorted set of NFA
+ * instructions it stands for; transitions are filled in the first time they
+ * are taken. The cache is bounded: once REGEX_CACHE_STATES states or
+ * REGEX_CACHE_POOL set entries are in use it is flushed and rebuilt from
+ * the states the scan touches next, so memory stays fixed while matching
+ * stays linear. Entries are premultiplied row offsets with match flags on
+ * top: AFTER means a match ends after this byte, BEFORE means one ended just
+ * before it (a $ satisfied by this newline).
+ */
+#define REGEX_CACHE_STATES 2048
+#define REGEX_CACHE_POOL (1 << 20)
+#define REGEX_BUCKETS (2 * REGEX_CACHE_STATES)
+#define RX_MATCH_AFTER 0x80000000u
+#define RX_MATCH_BEFORE 0x40000000u
+#define RX_ROW_MASK 0x3FFFFFFFu
+#define RX_UNKNOWN UINT32_MAX
 
-        int fits = 0;
-        uint32_t value;
+enum { RX_STATE_MATCH = 1, RX_STATE_EOL_MATCH = 2, RX_STATE_BOL = 4, RX_STATE_HAS_EOL = 8 };
 
-        printf("Checking file %s with mask: 0x%08X\n", files[currFileIndex], mask);
+typedef struct RegexDfa {
+    const Regex *regex;
+    uint32_t *next;
+    uint32_t *setStart;
+    uint32_t *setLength;
+    uint8_t *flags;
+    int32_t *pool;
+    size_t poolUsed;
+    int32_t *buckets;
+    int32_t *chain;
+    int stateCount;
+    /* the states with no match in progress, entered after a newline or not */
+    uint32_t idleRows[2];
+    int32_t *stack;
+    int32_t *scratch;
+    int32_t *work;
+    uint32_t *mark;
+    uint32_t generation;
+    struct RegexDfa *nextFree;
+} RegexDfa;
 
-        while (fread(&value, sizeof(uint32_t), 1, file_p) == 1) {
-            uint32_t maskedValue = value & mask;
-            if (maskedValue == mask) {
-                printf("Value: 0x%08X, Mask: 0x%08X\n", 
-                    value, mask);
-                fits = fits + 1;
+/* Adds index and everything it reaches without consuming a byte; assertions pass only when bol/eol hold. */
+static void rx_closure(RegexDfa *dfa, int32_t index, int bol, int eol, int32_t *set, int *length) {
+    const RegexInst *insts = dfa->regex->insts;
+    int top = 0;
+    dfa->stack[top++] = index;
+    while (top > 0) {
+        int32_t i = dfa->stack[--top];
+        if (i < 0 || dfa->mark[i] == dfa->generation) {
+            continue;
+        }
+        dfa->mark[i] = dfa->generation;
+        switch (insts[i].op) {
+        case RX_JUMP:
+            dfa->stack[top++] = insts[i].out;
+            break;
+        case RX_SPLIT:
+            dfa->stack[top++] = insts[i].out1;
+            dfa->stack[top++] = insts[i].out;
+            break;
+        case RX_BOL:
+            if (bol) {
+                dfa->stack[top++] = insts[i].out;
+            }
+            break;
+        case RX_EOL:
+            if (eol) {
+                dfa->stack[top++] = insts[i].out;
+            } else {
+                set[(*length)++] = i;
             }
+            break;
+        default:
+            set[(*length)++] = i;
+            break;
         }
-
-        printf("found %d matches in %s\n", fits, files[currFileIndex]);
-        fclose(file_p);
-        currFileIndex = currFileIndex + 1;
     }
+}
 
-    return 0;
+static int rx_compare(const void *a, const void *b) {
+    int32_t x = *(const int32_t *)a;
+    int32_t y = *(const int32_t *)b;
+    return (x > y) - (x < y);
 }
 
-int copyN(int fileCount, char *files[], int N) {
-    if (N > MAX_N) {
-        printf("Too big N\n");
-        return 0;
+/* Follows every $ in a state as if a newline came next, into dfa->work. */
+static int rx_expand_eol(RegexDfa *dfa, const int32_t *set, int length, int bol) {
+    const RegexInst *insts = dfa->regex->insts;
+    int count = 0;
+    dfa->generation++;
+    for (int k = 0; k < length; k++) {
+        dfa->mark[set[k]] = dfa->generation;
+        dfa->work[count++] = set[k];
     }
-    int totalProcesses = fileCount * N;
-    pid_t *pids = (pid_t *)malloc(totalProcesses * sizeof(pid_t));
-    if (!pids) {
-        printf("PID memory allocation error");
-        return 0;
+    for (int k = 0; k < length; k++) {
+        if (insts[set[k]].op == RX_EOL) {
+            rx_closure(dfa, insts[set[k]].out, bol, 1, dfa->work, &count);
+        }
     }
-    int pidCount = 0;
-
-    for (int fileIdx = 0; fileIdx < fileCount; fileIdx++) {
-        for (int copyIdx = 0; copyIdx < N; copyIdx++) {
-            pid_t pid = fork();
-            if (pid == 0) {
-                char newFilename[256];
-                char *dot = strrchr(files[fileIdx], '.');
-                if (dot) {
-                    
-                    size_t nameLength = dot - files[fileIdx];
-                    strncpy(newFilename, files[fileIdx], nameLength);
-                    newFilename[nameLength] = '\0';
-                    snprintf(newFilename + nameLength, sizeof(newFilename) - nameLength, 
-                            "_%d%s", copyIdx + 1, dot);
-                } else {
-                    
-                    snprintf(newFilename, sizeof(newFilename), "%s_%d", 
-                            files[fileIdx], copyIdx + 1);
-                }
-                
-                FILE *source = fopen(files[fileIdx], "rb");
-                if (!source) {
-                    printf("Error opening source file: %s\n", files[fileIdx]);
-                    return 0;
-                }
-                FILE *dest = fopen(newFilename, "wb");
-                if (!dest) {
-                    printf("Error opening dest file: %s\n", newFilename);
-                    fclose(source);
-                    return 0;
-                }
-
-                uint8_t buffer[4096];
-                size_t bytes;
-                while ((bytes = fread(buffer, 1, sizeof(buffer), source)) > 0) {
-                    if (fwrite(buffer, 1, bytes, dest) != bytes) {
-                        fclose(source);
-                        fclose(dest);
-                        return 0;
-                    }
-                }
+    return count;
+}
 
-                fclose(source);
-                fclose(dest);
-                return 1;
-            } else if (pid > 0) {
-                pids[pidCount++] = pid;
-            }
+/* Returns the row of the state for set (sorted in place), adding it if new; -1 when the cache is full. */
+static int64_t rx_state(RegexDfa *dfa, int32_t *set, int length, int bol) {
+    const Regex *regex = dfa->regex;
+    qsort(set, (size_t)length, sizeof(int32_t), rx_compare);
+    uint8_t bolFlag = regex->hasBol && bol ? RX_STATE_BOL : 0;
+    uint32_t hash = 2166136261u ^ bolFlag;
+    for (int k = 0; k < length; k++) {
+        hash = (hash ^ (uint32_t)set[k]) * 16777619u;
+    }
+    int32_t *bucket = &dfa->buckets[hash & (REGEX_BUCKETS - 1)];
+    for (int32_t s = *bucket; s >= 0; s = dfa->chain[s]) {
+        if (dfa->setLength[s] == (uint32_t)length && (dfa->flags[s] & RX_STATE_BOL) == bolFlag &&
+            memcmp(dfa->pool + dfa->setStart[s], set, (size_t)length * sizeof(int32_t)) == 0) {
+            return (int64_t)s * regex->classCount;
         }
     }
-
-    int remaining = pidCount;
-    int failures = 0;
-    while (remaining > 0) {
-        for (int i = 0; i < pidCount; i++) {
-            if (pids[i] > 0) {
-                int status;
-                pid_t result = waitpid(pids[i], &status, WNOHANG);
-                if (result > 0) {
-                    if (WIFEXITED(status) && WEXITSTATUS(status) != 1) {
-                        failures++;
-                    }
-                    pids[i] = -1;
-                    remaining--;
-                }
+    if (dfa->stateCount == REGEX_CACHE_STATES || dfa->poolUsed + (size_t)length > REGEX_CACHE_POOL) {
+        return -1;
+    }
+    int s = dfa->stateCount++;
+    int32_t *members = dfa->pool + dfa->poolUsed;
+    memcpy(members, set, (size_t)length * sizeof(int32_t));
+    dfa->setStart[s] = (uint32_t)dfa->poolUsed;
+    dfa->setLength[s] = (uint32_t)length;
+    dfa->poolUsed += (size_t)length;
+    uint8_t flags = bolFlag;
+    for (int k = 0; k < length; k++) {
+        if (members[k] == regex->match) {
+            flags |= RX_STATE_MATCH;
+        } else if (regex->insts[members[k]].op == RX_EOL) {
+            flags |= RX_STATE_HAS_EOL;
+        }
+    }
+    if ((flags & RX_STATE_HAS_EOL) && !(flags & RX_STATE_MATCH)) {
+        int count = rx_expand_eol(dfa, members, length, bolFlag != 0);
+        for (int k = length; k < count; k++) {
+            if (dfa->work[k] == regex->match) {
+                flags |= RX_STATE_EOL_MATCH;
             }
         }
-        usleep(1000);
     }
+    dfa->flags[s] = flags;
+    for (int c = 0; c < regex->classCount; c++) {
+        dfa->next[(size_t)s * regex->classCount + c] = RX_UNKNOWN;
+    }
+    dfa->chain[s] = *bucket;
+    *bucket = s;
+    return (int64_t)s * regex->classCount;
+}
 
-    if (failures > 0) {
-        printf("Some copy operations failed (%d failures)\n", failures);
+static void rx_flush(RegexDfa *dfa) {
+    dfa->stateCount = 0;
+    dfa->poolUsed = 0;
+    memset(dfa->buckets, -1, REGEX_BUCKETS * sizeof(int32_t));
+    for (int bol = 0; bol < 2; bol++) {
+        int length = 0;
+        dfa->generation++;
+        rx_closure(dfa, dfa->regex->start, bol, 0, dfa->work, &length);
+        dfa->idleRows[bol] = (uint32_t)rx_state(dfa, dfa->work, length, bol);
     }
-    free(pids);
-    return 0;
 }
 
-int find_string_in_files(int fileCount, char *files[], const char *searchStr) {
-    if (strlen(searchStr) == 0) {
-        printf("Error: Empty search string provided.\n");
-        return 0;
+/* Computes the transition out of row on byteClass, flushing the cache if it is full. */
+static uint32_t rx_fill(RegexDfa *dfa, uint32_t row, int byteClass) {
+    const Regex *regex = dfa->regex;
+    uint32_t state = row / (uint32_t)regex->classCount;
+    int byte = regex->classByte[byteClass];
+    int newline = byte == '\n';
+    uint8_t flags = dfa->flags[state];
+    const int32_t *source = dfa->pool + dfa->setStart[state];
+    int sourceLength = (int)dfa->setLength[state];
+    if (newline && (flags & RX_STATE_HAS_EOL)) {
+        sourceLength = rx_expand_eol(dfa, source, sourceLength, (flags & RX_STATE_BOL) != 0);
+        source = dfa->work;
     }
 
-    pid_t *pids = malloc(fileCount * sizeof(pid_t));
-    if (!pids) {
-        printf("Cannot allocate memory for process IDs\n");
-        return 0;
+    int length = 0;
+    dfa->generation++;
+    for (int k = 0; k < sourceLength; k++) {
+        const RegexInst *inst = &regex->insts[source[k]];
+        if (inst->op == RX_SET && rx_set_has(inst->set, byte)) {
+            rx_closure(dfa, inst->out, newline, 0, dfa->scratch, &length);
+        }
     }
-    int pidCount = 0;
+    rx_closure(dfa, regex->start, newline, 0, dfa->scratch, &length);
 
-    for (int i = 0; i < fileCount; i++) {
-        pid_t pid = fork();
-        if (pid == 0) {
-            FILE *file = fopen(files[i], "r");
-            if (!file) {
-                printf("Error opening file %s\n", files[i]);
-                free(pids);
-                return 1;
-            }
+    uint32_t matchBefore = newline && (flags & RX_STATE_EOL_MATCH) ? RX_MATCH_BEFORE : 0;
+    int64_t target = rx_state(dfa, dfa->scratch, length, newline);
+    int cached = target >= 0;
+    if (!cached) {
+        /* the flush only touches work, so the new set in scratch survives it */
+        rx_flush(dfa);
+        target = rx_state(dfa, dfa->scratch, length, newline);
+    }
+    uint32_t entry = (uint32_t)target | matchBefore;
+    if (dfa->flags[target / regex->classCount] & RX_STATE_MATCH) {
+        entry |= RX_MATCH_AFTER;
+    }
+    if (cached) {
+        dfa->next[row + (uint32_t)byteClass] = entry;
+    }
+    return entry;
+}
 
-            char *line = NULL;
-            size_t len = 0;
-            int found = 0;
+static void regex_dfa_free(RegexDfa *dfa) {
+    if (dfa == NULL) {
+        return;
+    }
+    free(dfa->next);
+    free(dfa->setStart);
+    free(dfa->setLength);
+    free(dfa->flags);
+    free(dfa->pool);
+    free(dfa->buckets);
+    free(dfa->chain);
+    free(dfa->stack);
+    free(dfa->scratch);
+    free(dfa->work);
+    free(dfa->mark);
+    free(dfa);
+}
 
-            while (getline(&line, &len, file) != -1) {
-                if (strstr(line, searchStr)) {
-                    printf("Match located in: %s\n", files[i]);
-                    found = 1;
-                    break;
+static RegexDfa *regex_dfa_new(const Regex *regex) {
+    RegexDfa *dfa = (RegexDfa *)calloc(1, sizeof(RegexDfa));
+    if (dfa == NULL) {
+        return NULL;
+    }
+    size_t insts = (size_t)regex->instCount;
+    dfa->regex = regex;
+    dfa->next = (uint32_t *)malloc((size_t)REGEX_CACHE_STATES * regex->classCount * sizeof(uint32_t));
+    dfa->setStart = (uint32_t *)malloc(REGEX_CACHE_STATES * sizeof(uint32_t));
+    dfa->setLength = (uint32_t *)malloc(REGEX_CACHE_STATES * sizeof(uint32_t));
+    dfa->flags = (uint8_t *)malloc(REGEX_CACHE_STATES);
+    dfa->pool = (int32_t *)malloc(REGEX_CACHE_POOL * sizeof(int32_t));
+    dfa->buckets = (int32_t *)malloc(REGEX_BUCKETS * sizeof(int32_t));
+    dfa->chain = (int32_t *)malloc(REGEX_CACHE_STATES * sizeof(int32_t));
+    dfa->stack = (int32_t *)malloc((2 * insts + 1) * sizeof(int32_t));
+    dfa->scratch = (int32_t *)malloc(insts * sizeof(int32_t));
+    dfa->work = (int32_t *)malloc(insts * sizeof(int32_t));
+    dfa->mark = (uint32_t *)calloc(insts, sizeof(uint32_t));
+    if (!dfa->next || !dfa->setStart || !dfa->setLength || !dfa->flags || !dfa->pool || !dfa->buckets ||
+        !dfa->chain || !dfa->stack || !dfa->scratch || !dfa->work || !dfa->mark) {
+        regex_dfa_free(dfa);
+        return NULL;
+    }
+    rx_flush(dfa);
+    return dfa;
+}
+
+/*
+ * Regex counterpart of search_file: returns the end offset of the first
+ * match, -1 when there is none and -2 when the file cannot be read. With
+ * report set, every offset at which a match ends is written there and the
+ * number of them is returned. While no match is in progress, memmem jumps
+ * to the next occurrence of the pattern's literal prefix.
+ */
+static int64_t regex_search_file(RegexDfa *dfa, const char *path, FILE *report, const int *cancel) {
+    const Regex *regex = dfa->regex;
+    InputReader reader;
+    if (input_open(&reader, path, options.ioBackend) != 0) {
+        return -2;
+    }
+    uint32_t row = dfa->idleRows[1];
+    uint64_t chunkStart = 0;
+    uint64_t count = 0;
+    int64_t result = -1;
+    /* a pattern that matches the empty string matches at offset 0 already */
+    if (dfa->flags[row / (uint32_t)regex->classCount] & RX_STATE_MATCH) {
+        if (report == NULL) {
+            result = 0;
+        } else {
+            result_find_offset(report, path, NULL, 0);
+            count++;
+        }
+    }
+    const uint8_t *chunk;
+    ssize_t bytes = 0;
+    while (result < 0 && !__atomic_load_n(cancel, __ATOMIC_RELAXED) && (bytes = input_next(&reader, &chunk)) > 0) {
+        size_t length = (size_t)bytes;
+        size_t i = 0;
+        while (i < length) {
+            if (regex->prefixLength > 0 && (row == dfa->idleRows[0] || row == dfa->idleRows[1])) {
+                const uint8_t *hit = (const uint8_t *)memmem(chunk + i, length - i, regex->prefix, regex->prefixLength);
+                /* without a hit, only a prefix split across chunks can still start here */
+                size_t skipTo = hit != NULL ? (size_t)(hit - chunk)
+                              : (length - i > regex->prefixLength - 1 ? length - (regex->prefixLength - 1) : i);
+                if (skipTo > i) {
+                    row = dfa->idleRows[chunk[skipTo - 1] == '\n'];
+                    i = skipTo;
+                    if (i == length) {
+                        break;
+                    }
                 }
             }
-
-            free(line);
-            fclose(file);
-            free(pids);
-            if (found) {
-                return 0;
-            } else {
-                return 1;
+            uint32_t byteClass = regex->classOf[chunk[i]];
+            uint32_t entry = dfa->next[row + byteClass];
+            if (entry == RX_UNKNOWN) {
+                entry = rx_fill(dfa, row, (int)byteClass);
+            }
+            row = entry & RX_ROW_MASK;
+            if (entry & (RX_MATCH_BEFORE | RX_MATCH_AFTER)) {
+                if (report == NULL) {
+                    result = (int64_t)(chunkStart + i + ((entry & RX_MATCH_BEFORE) ? 0 : 1));
+                    break;
+                }
+                if (entry & RX_MATCH_BEFORE) {
+                    result_find_offset(report, path, NULL, chunkStart + i);
+                    count++;
+                }
+                if (entry & RX_MATCH_AFTER) {
+                    result_find_offset(report, path, NULL, chunkStart + i + 1);
+                    count++;
+                }
             }
-        } else if (pid < 0) {
-            printf("Process creation failed\n");
+            i++;
+        }
+        chunkStart += length;
+    }
+    /* a $ at the very end of the input */
+    if (result < 0 && bytes == 0 && (dfa->flags[row / (uint32_t)regex->classCount] & RX_STATE_EOL_MATCH)) {
+        if (report == NULL) {
+            result = (int64_t)chunkStart;
         } else {
-            pids[pidCount++] = pid;
+            result_find_offset(report, path, NULL, chunkStart);
+            count++;
         }
     }
+    input_close(&reader);
+    if (result < 0 && bytes < 0) {
+        return -2;
+    }
+    return report != NULL ? (int64_t)count : result;
+}
 
-    int remaining = pidCount;
-    int found = 0;
-    while (remaining > 0) {
-        for (int i = 0; i < pidCount; i++) {
-            if (pids[i] > 0) {
-                int status;
-                pid_t result = waitpid(pids[i], &status, WNOHANG);
-                if (result > 0) {
-                    if (WIFEXITED(status) && WEXITSTATUS(status) == 1) {
-                        found = 1;
-                    }
-                    pids[i] = -1;
-                    remaining--;
-                }
+/*
+ * Search state shared by all find tasks. Everything is read-only except the
+ * lazy DFAs, which are handed out one per running task from a free list.
+ */
+typedef struct {
+    const PatternList *patterns;
+    Searcher searcher;
+    AhoCorasick ac;
+    Regex regex;
+    pthread_mutex_t dfaLock;
+    RegexDfa *freeDfas;
+} FindContext;
+
+static RegexDfa *find_take_dfa(FindContext *context) {
+    pthread_mutex_lock(&context->dfaLock);
+    RegexDfa *dfa = context->freeDfas;
+    if (dfa != NULL) {
+        context->freeDfas = dfa->nextFree;
+    }
+    pthread_mutex_unlock(&context->dfaLock);
+    return dfa != NULL ? dfa : regex_dfa_new(&context->regex);
+}
+
+static void find_put_dfa(FindContext *context, RegexDfa *dfa) {
+    pthread_mutex_lock(&context->dfaLock);
+    dfa->nextFree = context->freeDfas;
+    context->freeDfas = dfa;
+    pthread_mutex_unlock(&context->dfaLock);
+}
+
+/* The single-pattern search: substring, or regex with --regex. */
+static int64_t find_single(FindContext *context, const char *path, FILE *report, const int *cancel) {
+    if (!options.findRegex) {
+        return search_file(&context->searcher, path, report, cancel);
+    }
+    RegexDfa *dfa = find_take_dfa(context);
+    if (dfa == NULL) {
+        return -2;
+    }
+    int64_t result = regex_search_file(dfa, path, report, cancel);
+    find_put_dfa(context, dfa);
+    return result;
+}
+
+static void find_file_task(FileJob *job, const char *path, FILE *out) {
+    FindContext *context = (FindContext *)job->context;
+    const PatternList *patterns = context->patterns;
+    int matched = 0;
+    if (options.findAll) {
+        int64_t count = patterns->count == 1
+                      ? find_single(context, path, out, &job->cancelled)
+                      : ac_report_file(&context->ac, patterns, path, out, &job->cancelled);
+        if (count < 0) {
+            result_error(out, path, "Error opening file %s\n");
+        } else {
+            result_find_count(out, path, (uint64_t)count);
+        }
+        matched = count > 0;
+    } else if (patterns->count == 1) {
+        int64_t offset = find_single(context, path, NULL, &job->cancelled);
+        if (offset == -2) {
+            result_error(out, path, "Error opening file %s\n");
+        } else if (offset >= 0) {
+            result_find(out, path, NULL);
+            matched = 1;
+        }
+    } else {
+        uint8_t *hits = (uint8_t *)malloc(patterns->count);
+        int foundCount = hits ? ac_search_file(&context->ac, path, hits, &job->cancelled) : -1;
+        if (foundCount < 0) {
+            result_error(out, path, "Error opening file %s\n");
+        }
+        for (int p = 0; p < patterns->count && foundCount > 0; p++) {
+            if (hits[p]) {
+                result_find(out, path, patterns->items[p]);
             }
         }
-        usleep(1000);
+        matched = foundCount > 0;
+        free(hits);
+    }
+    if (matched) {
+        __atomic_fetch_add(&job->matches, 1, __ATOMIC_RELAXED);
+    }
+}
+
+int find_string_in_files(int fileCount, char *files[], const PatternList *patterns) {
+    if (patterns->count == 0) {
+        printf("Error: Empty search string provided.\n");
+        return 0;
+    }
+    /* one pattern uses the substring searcher or regex DFA, several share one automaton pass */
+    FindContext context;
+    memset(&context, 0, sizeof(context));
+    context.patterns = patterns;
+    if (options.findRegex) {
+        if (patterns->count != 1) {
+            printf("Error: --regex takes a single pattern (combine alternatives with |)\n");
+            return 0;
+        }
+        if (regex_build(&context.regex, patterns->items[0], patterns->lengths[0]) != 0) {
+            return 0;
+        }
+        pthread_mutex_init(&context.dfaLock, NULL);
+    } else if (patterns->count == 1) {
+        searcher_init(&context.searcher, (const uint8_t *)patterns->items[0], patterns->lengths[0]);
+    } else if (ac_build(&context.ac, patterns) != 0) {
+        return 0;
     }
 
-    if (!found) {
-        printf("No occurrences of '%s' found in the files.\n", searchStr);
+    FileJob job = { .files = files, .run = find_file_task, .context = &context };
+    int status = run_file_tasks(&job, fileCount);
+
+    if (options.format != FORMAT_TEXT) {
+        /* structured output has no summary line: an absent find record means no match */
+    } else if (status == 0 && job.matches == 0 && patterns->count == 1) {
+        printf("No occurrences of '%s' found in the files.\n", patterns->items[0]);
+    } else if (status == 0 && job.matches == 0) {
+        printf("No occurrences of the %d patterns found in the files.\n", patterns->count);
+    }
+    if (options.findRegex) {
+        while (context.freeDfas != NULL) {
+            RegexDfa *next = context.freeDfas->nextFree;
+            regex_dfa_free(context.freeDfas);
+            context.freeDfas = next;
+        }
+        pthread_mutex_destroy(&context.dfaLock);
+        regex_free(&context.regex);
+    } else if (patterns->count > 1) {
+        ac_free(&context.ac);
     }
-    free(pids);
     return 0;
 }
 
 int show_info() {
-    printf("Usage: ./a.out <file1> <file2> ... <flag> <arg>\n");
+    printf("Usage: ./a.out [options] <file1> <file2> ... <flag> <arg>\n");
+    printf("A file named - reads standard input (xor, mask, find)\n");
+    printf("Directories are searched recursively (symlinks inside them are not followed)\n");
+    printf("Options:\n");
+    printf("--include=<glob> - in directories, only take files whose name matches (repeatable)\n");
+    printf("--exclude=<glob> - in directories, skip files and subdirectories whose name matches (repeatable)\n");
+    printf("--io=stream|mmap|uring|direct - input backend (default stream); direct reads around the page cache\n");
+    printf("--depth=<N> - io_uring and direct reads kept in flight (default 8)\n");
+    printf("-j <N> - number of worker threads (default: number of cores)\n");
+    printf("--isolate - find/copy: handle every file in its own child process\n");
+    printf("--any - find: stop all workers once one file matched\n");
+    printf("--all - find: report every match offset and the match count of each file\n");
+    printf("--regex - find: the pattern is a regular expression; --all then reports where matches end\n");
+    printf("-e <pattern> - find: add a search pattern (repeatable)\n");
+    printf("--patterns=<file> - find: add one search pattern per line of file\n");
+    printf("--count - mask: only report the number of matches\n");
+    printf("--first=<K> - mask: list the first K matches with their offsets\n");
+    printf("-M <hex> - mask: add a mask to evaluate in the same pass (repeatable)\n");
+    printf("--masks=<file> - mask: add one hex mask per line of file\n");
+    printf("--width=8|16|32|64 - mask: word width in bits (default 32)\n");
+    printf("--endian=native|little|big - mask: byte order of the words (default native)\n");
+    printf("--histogram - mask: count how often each bit is set in matching words\n");
+    printf("--index - mask: answer from <file>.midx when it is up to date, scan otherwise\n");
+    printf("--cache=<file> - xor: reuse results of files whose size and mtime are unchanged\n");
+    printf("--cache-compact - xor: drop cache entries not used by this run\n");
+    printf("--crc32c - xor: also compute the CRC32C of each file in the same pass\n");
+    printf("--xxh64 - xor: also compute the XXH64 of each file in the same pass\n");
+    printf("--format=text|ndjson|binary - result output format (default text)\n");
     printf("Flags:\n");
-    printf("xor<N> - XOR blocks of 2^N bits (N=2,3,4,5,6)\n");
+    printf("xor<N> - XOR blocks of 2^N bits (N=2..30)\n");
+    printf("xor<N>,<N>,... - XOR several block widths in one pass\n");
+    printf("crc32c - CRC32C checksum of each file (add --xxh64 for both)\n");
+    printf("xxh64 - XXH64 hash of each file (add --crc32c for both)\n");
     printf("mask <hex> - counting 4-byte integers matching the mask\n");
     printf("copy<N> - creating N copies of each file, numbering each copy\n");
     printf("find <string> - searches for a string in files\n");
+    printf("dedupe - lists groups of files with identical content (hard links are listed apart)\n");
+    printf("index - writes <file>.midx, a bitmap index of the words for mask --index (honours --width/--endian)\n");
+    printf("find - with -e/--patterns, searches for all patterns in one pass\n");
+    printf("mask - with -M/--masks, counts every mask in one pass (no listing without --first)\n");
 
     return 0;
 }
 
+static int parse_option(int argc, char *argv[], int *argi) {
+    const char *option = argv[*argi];
+    if (strncmp(option, "-j", 2) == 0) {
+        const char *value = option + 2;
+        if (*value == '\0') {
+            if (*argi + 1 >= argc) {
+                printf("Error: -j needs a worker count\n");
+                return -1;
+            }
+            value = argv[++*argi];
+        }
+        char *endptr;
+        long jobs = strtol(value, &endptr, 10);
+        if (*value == '\0' || *endptr != '\0' || jobs <= 0 || jobs > 4096) {
+            printf("Error: Invalid worker count: %s\n", value);
+            return -1;
+        }
+        options.jobs = (int)jobs;
+    } else if (strcmp(option, "--isolate") == 0) {
+        options.isolate = 1;
+    } else if (strcmp(option, "--any") == 0) {
+        options.stopOnMatch = 1;
+    } else if (strncmp(option, "--include=", 10) == 0) {
+        return glob_list_add(&includeGlobs, option + 10);
+    } else if (strncmp(option, "--exclude=", 10) == 0) {
+        return glob_list_add(&excludeGlobs, option + 10);
+    } else if (strcmp(option, "--crc32c") == 0) {
+        options.checksums |= CHECKSUM_CRC32C;
+    } else if (strcmp(option, "--xxh64") == 0) {
+        options.checksums |= CHECKSUM_XXH64;
+    } else if (strcmp(option, "--regex") == 0) {
+        options.findRegex = 1;
+    } else if (strcmp(option, "--all") == 0) {
+        options.findAll = 1;
+    } else if (strcmp(option, "-e") == 0) {
+        if (*argi + 1 >= argc) {
+            printf("Error: -e needs a pattern\n");
+            return -1;
+        }
+        return pattern_list_add(&patternList, argv[++*argi]);
+    } else if (strncmp(option, "--patterns=", 11) == 0) {
+        return pattern_list_load(&patternList, option + 11);
+    } else if (strcmp(option, "--io=stream") == 0) {
+        options.ioBackend = IO_STREAM;
+    } else if (strcmp(option, "--io=mmap") == 0) {
+        options.ioBackend = IO_MMAP;
+    } else if (strcmp(option, "--io=uring") == 0) {
+        options.ioBackend = IO_URING;
+    } else if (strcmp(option, "--io=direct") == 0) {
+        options.ioBackend = IO_DIRECT;
+    } else if (strcmp(option, "-M") == 0) {
+        if (*argi + 1 >= argc) {
+            printf("Error: -M needs a mask\n");
+            return -1;
+        }
+        return mask_set_add(&maskSet, argv[++*argi]);
+    } else if (strncmp(option, "--masks=", 8) == 0) {
+        return mask_set_load(&maskSet, option + 8);
+    } else if (strncmp(option, "--width=", 8) == 0) {
+        char *endptr;
+        long bits = strtol(option + 8, &endptr, 10);
+        if (option[8] == '\0' || *endptr != '\0' || (bits != 8 && bits != 16 && bits != 32 && bits != 64)) {
+            printf("Error: Invalid word width: %s\n", option + 8);
+            return -1;
+        }
+        options.wordBits = (int)bits;
+    } else if (strcmp(option, "--endian=native") == 0) {
+        options.bigEndian = __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__;
+    } else if (strcmp(option, "--endian=little") == 0) {
+        options.bigEndian = 0;
+    } else if (strcmp(option, "--endian=big") == 0) {
+        options.bigEndian = 1;
+    } else if (strncmp(option, "--cache=", 8) == 0 && option[8] != '\0') {
+        options.cachePath = option + 8;
+    } else if (strcmp(option, "--cache-compact") == 0) {
+        options.cacheCompact = 1;
+    } else if (strcmp(option, "--index") == 0) {
+        options.maskIndex = 1;
+    } else if (strcmp(option, "--histogram") == 0) {
+        options.maskHistogram = 1;
+    } else if (strcmp(option, "--format=text") == 0) {
+        options.format = FORMAT_TEXT;
+    } else if (strcmp(option, "--format=ndjson") == 0) {
+        options.format = FORMAT_NDJSON;
+    } else if (strcmp(option, "--format=binary") == 0) {
+        options.format = FORMAT_BINARY;
+    } else if (strncmp(option, "--depth=", 8) == 0) {
+        char *endptr;
+        long depth = strtol(option + 8, &endptr, 10);
+        if (option[8] == '\0' || *endptr != '\0' || depth <= 0 || depth > 256) {
+            printf("Error: Invalid queue depth: %s\n", option + 8);
+            return -1;
+        }
+        options.queueDepth = (int)depth;
+    } else if (strcmp(option, "--count") == 0) {
+        options.maskListLimit = 0;
+    } else if (strncmp(option, "--first=", 8) == 0) {
+        char *endptr;
+        options.maskListLimit = strtoull(option + 8, &endptr, 10);
+        if (option[8] == '\0' || *endptr != '\0' || options.maskListLimit == UINT64_MAX) {
+            printf("Error: Invalid match limit: %s\n", option + 8);
+            return -1;
+        }
+    } else {
+        printf("Unknown option: %s\n", option);
+        return -1;
+    }
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
+    int argi = 1;
+    while (argi < argc && argv[argi][0] == '-' && argv[argi][1] != '\0') {
+        if (strcmp(argv[argi], "--") == 0) {
+            argi++;
+            break;
+        }
+        if (parse_option(argc, argv, &argi) != 0) {
+            show_info();
+            return -1;
+        }
+        argi++;
+    }
+    argc -= argi - 1;
+    argv += argi - 1;
+
+    /* results reach stdout in large batches unless a terminal is watching text output */
+    if (options.format != FORMAT_TEXT || !isatty(STDOUT_FILENO)) {
+        setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+    }
+
     if (argc < 3) {
         show_info();
         return 1;
@@ -316,12 +6601,41 @@ int main(int argc, char *argv[]) {
     int N;
 
     if (strstr(flag, "xor") == flag) {
-        sscanf(flag, "xor%d", &N);
-        if (N < 2 || N > 6) {
-            printf("Error: N for xorN must be between 2 and 6.\n");
+        /* xor<N>[,<N>...] computes every listed width in one pass */
+        int ns[MAX_XOR_WIDTHS];
+        int nCount = 0;
+        const char *list = flag + 3;
+        while (1) {
+            char *endptr;
+            long value = strtol(list, &endptr, 10);
+            if (endptr == list || value < 2 || value > MAX_XOR_N) {
+                printf("Error: N for xorN must be between 2 and %d.\n", MAX_XOR_N);
+                return -1;
+            }
+            if (nCount == MAX_XOR_WIDTHS) {
+                printf("Error: At most %d values of N per run.\n", MAX_XOR_WIDTHS);
+                return -1;
+            }
+            ns[nCount++] = (int)value;
+            if (*endptr != ',') {
+                break;
+            }
+            list = endptr + 1;
+        }
+        xorN(fileCount, argv + 1, ns, nCount);
+        return 1;
+    } else if (strcmp(flag, "crc32c") == 0 || strcmp(flag, "xxh64") == 0) {
+        options.checksums |= flag[0] == 'c' ? CHECKSUM_CRC32C : CHECKSUM_XXH64;
+        xorN(fileCount, argv + 1, NULL, 0);
+        return 1;
+    } else if (strcmp(flag, "mask") == 0 && maskSet.count > 0) {
+        count_mask_set(fileCount, argv + 1, &maskSet);
+        return 1;
+    } else if (strcmp(flagM, "mask") == 0 && (maskSet.count > 0 || options.maskHistogram)) {
+        if (argc < 4 || mask_set_add(&maskSet, arg) != 0) {
             return -1;
         }
-        xorN(fileCount, argv + 1, N);
+        count_mask_set(fileCount - 1, argv + 1, &maskSet);
         return 1;
     } else if (strcmp(flagM, "mask") == 0) {
         if (argc < 4) {
@@ -329,13 +6643,26 @@ int main(int argc, char *argv[]) {
             return -1;
         }
         char *endptr;
-        uint32_t mask = strtoul(arg, &endptr, 16);
+        uint64_t mask = strtoull(arg, &endptr, 16);
         if (*endptr != '\0') {
             printf("Error: Invalid hexadecimal mask: %s\n", arg);
             return -1;
         }
+        /* 32-bit words have always truncated wider masks; other widths reject them */
+        if (options.wordBits == 32) {
+            mask = (uint32_t)mask;
+        } else if (options.wordBits < 64 && (mask >> options.wordBits) != 0) {
+            printf("Error: Mask %s does not fit in %d-bit words\n", arg, options.wordBits);
+            return -1;
+        }
         count_mask_fits(fileCount - 1, argv + 1, mask);
         return 1;
+    } else if (strcmp(flag, "index") == 0) {
+        mask_index_files(fileCount, argv + 1);
+        return 1;
+    } else if (strcmp(flag, "dedupe") == 0) {
+        dedupe_files(fileCount, argv + 1);
+        return 1;
     } else if (strstr(flag, "copy") == flag) {
         sscanf(flag, "copy%d", &N);
         if (N <= 0) {
@@ -344,35 +6671,18 @@ int main(int argc, char *argv[]) {
         }
         copyN(fileCount, argv + 1, N);
         return 1;
+    } else if (strcmp(flag, "find") == 0 && patternList.count > 0) {
+        find_string_in_files(fileCount, argv + 1, &patternList);
+        return 1;
     } else if (strcmp(flagM, "find") == 0) {
         if (argc < 4) {
             printf("Not enough arguments (must be 4)");
             return -1;
         }
-        char * some_string = argv[argc - 1];
-        int len = strlen(some_string) + 1;
-        for (char * ptr = some_string; *ptr != '\0'; ++ptr) {
-            if (*ptr == '\\') {
-                switch (ptr[1])
-                {
-                case 'n':
-                    memmove(ptr, &ptr[1], len - (ptr - some_string) - 1);
-                    *ptr = '\n';
-                    break;
-                case 't':
-                    memmove(ptr, &ptr[1], len - (ptr - some_string) - 1);
-                    *ptr = '\t';
-                    break;
-                case '0':
-                    memmove(ptr, &ptr[1], len - (ptr - some_string) - 1);
-                    *ptr = '\0';
-                    break;
-                default:
-                    break;
-                }
-            }
+        if (pattern_list_add(&patternList, argv[argc - 1]) != 0) {
+            return -1;
         }
-        find_string_in_files(fileCount - 1, argv + 1, some_string);
+        find_string_in_files(fileCount - 1, argv + 1, &patternList);
         return 1;
     } else {
         printf("Unknown or absent flag\n");
@@ -0,0 +1,408 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+/*
+ * Throughput benchmark for the 2.c modes. Generates deterministic data
+ * sets, runs the compiled 2.c binary across modes, I/O backends and
+ * worker counts, and prints one JSON object per configuration.
+ *
+ *   gcc -O2 -pthread 2.c -o a.out && gcc -O2 2bench.c -o 2bench
+ *   ./2bench --tool=./a.out --sizes=64K,16M,1G > bench_output.txt
+ */
+
+#define MAX_LIST 16
+#define FILES_PER_SET 4
+#define GEN_BLOCK (1 << 20)
+#define BENCH_MASK "0f0f0f0f"
+#define BENCH_NEEDLE "fountain"
+
+enum { DATA_RANDOM, DATA_ZERO, DATA_DENSE };
+
+static const char *dataNames[] = { "random", "zero", "dense" };
+
+typedef struct {
+    const char *tool;
+    const char *dir;
+    uint64_t sizes[MAX_LIST];
+    int sizeCount;
+    int threads[MAX_LIST];
+    int threadCount;
+    char *modes[MAX_LIST];
+    int modeCount;
+    char *backends[MAX_LIST];
+    int backendCount;
+    int reps;
+    int keep;
+} BenchConfig;
+
+typedef struct {
+    double seconds;
+    long peakRssKb;
+    int status;
+    int errors;
+} RunResult;
+
+static uint64_t splitmix64(uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+static uint64_t parse_size(const char *text) {
+    char *end;
+    uint64_t value = strtoull(text, &end, 10);
+    switch (*end) {
+    case 'K': case 'k':
+        return value << 10;
+    case 'M': case 'm':
+        return value << 20;
+    case 'G': case 'g':
+        return value << 30;
+    default:
+        return value;
+    }
+}
+
+/* Splits a comma separated list in place. */
+static int split_list(char *text, char **items) {
+    int count = 0;
+    for (char *item = strtok(text, ","); item != NULL && count < MAX_LIST; item = strtok(NULL, ",")) {
+        items[count++] = item;
+    }
+    return count;
+}
+
+/*
+ * Dense data is built for the match-heavy paths: every 32-bit word has
+ * all bits of BENCH_MASK set with probability 1/2, and BENCH_NEEDLE shows
+ * up roughly every 4 KiB.
+ */
+static void fill_block(uint8_t *block, size_t length, int kind, uint64_t *state) {
+    if (kind == DATA_ZERO) {
+        memset(block, 0, length);
+        return;
+    }
+    for (size_t i = 0; i + 8 <= length; i += 8) {
+        uint64_t word = splitmix64(state);
+        if (kind == DATA_DENSE) {
+            if (word & 1) {
+                word |= 0x0F0F0F0Full;
+            }
+            if (word & 2) {
+                word |= 0x0F0F0F0F00000000ull;
+            }
+        }
+        memcpy(block + i, &word, 8);
+    }
+    if (kind == DATA_DENSE) {
+        size_t needle = strlen(BENCH_NEEDLE);
+        for (size_t i = 4096 - needle; i + needle <= length; i += 4096) {
+            memcpy(block + i, BENCH_NEEDLE, needle);
+        }
+    }
+}
+
+static int generate_file(const char *path, uint64_t size, int kind, uint64_t seed) {
+    struct stat st;
+    if (stat(path, &st) == 0 && (uint64_t)st.st_size == size) {
+        return 0;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    uint8_t *block = (uint8_t *)malloc(GEN_BLOCK);
+    if (block == NULL) {
+        close(fd);
+        return -1;
+    }
+    uint64_t state = seed;
+    uint64_t written = 0;
+    while (written < size) {
+        size_t length = size - written < GEN_BLOCK ? (size_t)(size - written) : GEN_BLOCK;
+        fill_block(block, length, kind, &state);
+        if (write(fd, block, length) != (ssize_t)length) {
+            fprintf(stderr, "Short write to %s\n", path);
+            free(block);
+            close(fd);
+            return -1;
+        }
+        written += length;
+    }
+    free(block);
+    return close(fd);
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* The tool runs with --format=ndjson, so per-file failures show up as records of these types. */
+static int count_error_records(FILE *output) {
+    char *line = NULL;
+    size_t length = 0;
+    int errors = 0;
+    rewind(output);
+    while (getline(&line, &length, output) != -1) {
+        errors += strstr(line, "\"type\":\"error\"") != NULL || strstr(line, "\"type\":\"copy_failures\"") != NULL;
+    }
+    free(line);
+    return errors;
+}
+
+/* Runs the tool with stdout captured in a temporary file and reports wall time, peak RSS and error records. */
+static RunResult run_tool(char *const argv[]) {
+    RunResult result = { 0.0, 0, -1, 0 };
+    FILE *output = tmpfile();
+    if (output == NULL) {
+        return result;
+    }
+    fflush(stdout);
+    double start = now_seconds();
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(fileno(output), STDOUT_FILENO);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    if (pid < 0) {
+        fclose(output);
+        return result;
+    }
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) == pid) {
+        result.seconds = now_seconds() - start;
+        result.peakRssKb = usage.ru_maxrss;
+        result.status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+        result.errors = count_error_records(output);
+    }
+    fclose(output);
+    return result;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(double *sorted, int count, double p) {
+    int index = (int)(p * (count - 1) + 0.5);
+    return sorted[index];
+}
+
+static void remove_copies(const char *path) {
+    char copy[4096];
+    const char *dot = strrchr(path, '.');
+    snprintf(copy, sizeof(copy), "%.*s_1%s", (int)(dot - path), path, dot);
+    unlink(copy);
+}
+
+/* Builds the argv for one mode; returns -1 for an unknown mode. */
+static int build_argv(const BenchConfig *config, const char *mode, const char *backend, int threads,
+                      const char *file, char *argv[], char *ioFlag, char *jobsFlag) {
+    int argc = 0;
+    snprintf(ioFlag, 32, "--io=%s", backend);
+    snprintf(jobsFlag, 32, "-j%d", threads);
+    argv[argc++] = (char *)config->tool;
+    argv[argc++] = ioFlag;
+    argv[argc++] = jobsFlag;
+    argv[argc++] = "--format=ndjson";
+    if (strcmp(mode, "xor") == 0) {
+        argv[argc++] = (char *)file;
+        argv[argc++] = "xor6";
+    } else if (strcmp(mode, "mask") == 0) {
+        argv[argc++] = "--count";
+        argv[argc++] = (char *)file;
+        argv[argc++] = "mask";
+        argv[argc++] = BENCH_MASK;
+    } else if (strcmp(mode, "find") == 0) {
+        argv[argc++] = (char *)file;
+        argv[argc++] = "find";
+        argv[argc++] = BENCH_NEEDLE "-absent";
+    } else if (strcmp(mode, "copy") == 0) {
+        argv[argc++] = (char *)file;
+        argv[argc++] = "copy1";
+    } else {
+        return -1;
+    }
+    argv[argc] = NULL;
+    return 0;
+}
+
+static void bench_config(const BenchConfig *config, const char *mode, const char *backend, int threads,
+                         int kind, uint64_t size, char files[][4096]) {
+    int samples = config->reps * FILES_PER_SET;
+    double *latencies = (double *)malloc(samples * sizeof(double));
+    if (latencies == NULL) {
+        return;
+    }
+    char ioFlag[32];
+    char jobsFlag[32];
+    char *argv[16];
+    double total = 0.0;
+    long peakRss = 0;
+    int count = 0;
+    int failed = 0;
+
+    for (int rep = -1; rep < config->reps; rep++) {
+        for (int f = 0; f < FILES_PER_SET; f++) {
+            if (build_argv(config, mode, backend, threads, files[f], argv, ioFlag, jobsFlag) != 0) {
+                fprintf(stderr, "Unknown mode %s\n", mode);
+                free(latencies);
+                return;
+            }
+            RunResult run = run_tool(argv);
+            if (strcmp(mode, "copy") == 0) {
+                remove_copies(files[f]);
+            }
+            /* the tool exits 1 after a normal run, 255 on usage errors; error records mean a file was skipped */
+            if (run.status != 1 || run.errors > 0) {
+                failed++;
+                continue;
+            }
+            /* rep -1 only warms the page cache */
+            if (rep < 0) {
+                continue;
+            }
+            latencies[count++] = run.seconds;
+            total += run.seconds;
+            if (run.peakRssKb > peakRss) {
+                peakRss = run.peakRssKb;
+            }
+        }
+    }
+
+    qsort(latencies, count, sizeof(double), compare_double);
+    double p50 = count > 0 ? percentile(latencies, count, 0.50) : 0.0;
+    double p99 = count > 0 ? percentile(latencies, count, 0.99) : 0.0;
+    double bytes = (double)size * count;
+    double words = strcmp(mode, "mask") == 0 ? bytes / 4.0 : (double)count;
+    printf("{\"mode\":\"%s\",\"backend\":\"%s\",\"threads\":%d,\"data\":\"%s\",\"size\":%llu,"
+           "\"runs\":%d,\"failed\":%d,\"gb_per_s\":%.4f,\"ops_per_s\":%.2f,"
+           "\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"peak_rss_kb\":%ld}\n",
+           mode, backend, threads, dataNames[kind], (unsigned long long)size,
+           count, failed, total > 0 ? bytes / total / 1e9 : 0.0, total > 0 ? words / total : 0.0,
+           p50 * 1e3, p99 * 1e3, peakRss);
+    fflush(stdout);
+    free(latencies);
+}
+
+static int show_usage(void) {
+    printf("Usage: ./2bench [options]\n");
+    printf("--tool=<path> - compiled 2.c binary (default ./a.out)\n");
+    printf("--dir=<path> - directory for generated data (default bench_data)\n");
+    printf("--sizes=<list> - file sizes, e.g. 64K,16M,10G (default 64K,16M,256M)\n");
+    printf("--threads=<list> - worker counts passed as -j (default 1,<cores>)\n");
+    printf("--modes=<list> - any of xor,mask,find,copy (default all)\n");
+    printf("--backends=<list> - any of stream,mmap,uring,direct (default all)\n");
+    printf("--reps=<N> - timed runs per file (default 5)\n");
+    printf("--keep - keep generated data after the run\n");
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    static char defaultModes[] = "xor,mask,find,copy";
+    static char defaultBackends[] = "stream,mmap,uring,direct";
+    static char defaultSizes[] = "64K,16M,256M";
+    BenchConfig config;
+    memset(&config, 0, sizeof(config));
+    config.tool = "./a.out";
+    config.dir = "bench_data";
+    config.reps = 5;
+    char *sizeList = defaultSizes;
+    char *threadList = NULL;
+    config.modeCount = split_list(defaultModes, config.modes);
+    config.backendCount = split_list(defaultBackends, config.backends);
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--tool=", 7) == 0) {
+            config.tool = argv[i] + 7;
+        } else if (strncmp(argv[i], "--dir=", 6) == 0) {
+            config.dir = argv[i] + 6;
+        } else if (strncmp(argv[i], "--sizes=", 8) == 0) {
+            sizeList = argv[i] + 8;
+        } else if (strncmp(argv[i], "--threads=", 10) == 0) {
+            threadList = argv[i] + 10;
+        } else if (strncmp(argv[i], "--modes=", 8) == 0) {
+            config.modeCount = split_list(argv[i] + 8, config.modes);
+        } else if (strncmp(argv[i], "--backends=", 11) == 0) {
+            config.backendCount = split_list(argv[i] + 11, config.backends);
+        } else if (strncmp(argv[i], "--reps=", 7) == 0) {
+            config.reps = atoi(argv[i] + 7);
+        } else if (strcmp(argv[i], "--keep") == 0) {
+            config.keep = 1;
+        } else {
+            return show_usage();
+        }
+    }
+    if (config.reps <= 0 || access(config.tool, X_OK) != 0) {
+        fprintf(stderr, "Tool %s is not executable\n", config.tool);
+        return show_usage();
+    }
+
+    char *items[MAX_LIST];
+    int sizeCount = split_list(sizeList, items);
+    for (int i = 0; i < sizeCount; i++) {
+        config.sizes[config.sizeCount++] = parse_size(items[i]);
+    }
+    if (threadList != NULL) {
+        int threadCount = split_list(threadList, items);
+        for (int i = 0; i < threadCount; i++) {
+            config.threads[config.threadCount++] = atoi(items[i]);
+        }
+    } else {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        config.threads[config.threadCount++] = 1;
+        if (cores > 1) {
+            config.threads[config.threadCount++] = (int)cores;
+        }
+    }
+    if (mkdir(config.dir, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Cannot create %s: %s\n", config.dir, strerror(errno));
+        return 1;
+    }
+
+    for (int s = 0; s < config.sizeCount; s++) {
+        for (int kind = DATA_RANDOM; kind <= DATA_DENSE; kind++) {
+            char files[FILES_PER_SET][4096];
+            int ready = 1;
+            for (int f = 0; f < FILES_PER_SET && ready; f++) {
+                snprintf(files[f], sizeof(files[f]), "%s/%s_%llu_%d.bin", config.dir, dataNames[kind],
+                         (unsigned long long)config.sizes[s], f);
+                uint64_t seed = ((uint64_t)kind << 56) ^ (config.sizes[s] << 8) ^ (uint64_t)f;
+                ready = generate_file(files[f], config.sizes[s], kind, seed) == 0;
+            }
+            if (!ready) {
+                return 1;
+            }
+            for (int m = 0; m < config.modeCount; m++) {
+                for (int b = 0; b < config.backendCount; b++) {
+                    for (int t = 0; t < config.threadCount; t++) {
+                        bench_config(&config, config.modes[m], config.backends[b], config.threads[t],
+                                     kind, config.sizes[s], files);
+                    }
+                }
+            }
+            for (int f = 0; f < FILES_PER_SET && !config.keep; f++) {
+                unlink(files[f]);
+            }
+        }
+    }
+    return 0;
+}